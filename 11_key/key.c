@@ -11,6 +11,19 @@
 #include <linux/of.h>
 #include <linux/of_address.h>
 #include <linux/of_gpio.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/mach/map.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
@@ -18,117 +31,673 @@
 #define KEY_CNT     1
 #define KEY_NAME    "key"
 
-#define KEY0VALUE   0XF0
-#define INVAKEY     0x00
+#define GPIO_PSR    0X08    /* i.MX GPIO的PSR寄存器，一次读出一组32个引脚的电平 */
 
+/* 矩阵键盘 */
+#define MATRIX_MAX_ROWS     8
+#define MATRIX_MAX_COLS     8
+#define SETTLE_US_DEF       5       /* 拉低一行后等待列电平稳定的时间 */
+#define SCAN_US_DEF         5000    /* 有按键活动时的扫描周期 */
+#define DEBOUNCE_SCANS      3       /* 连续几次扫描结果一致才算稳定 */
+#define IDLE_SCANS          8       /* 连续几次扫描没有按键就停止扫描，等待列中断 */
+#define KEY_FIFO_SIZE       256     /* 事件队列大小，必须是2的幂 */
+#define KEY_EV_PRESS        0X80    /* 事件字节最高位为1表示按下，低7位为按键编号 */
+
+/* 轮询模式 */
+#define KEY_MAX_KEYS        32      /* 按键按u32位图消抖 */
+#define POLL_TIMER          0       /* 在hrtimer回调中采样 */
+#define POLL_WORKER         1       /* hrtimer唤醒kthread worker采样，可以睡眠 */
+
+/* debugfs中导出的扫描计数，时间单位ns */
+struct key_scan_stats {
+    unsigned int scans;         /* 扫描次数 */
+    unsigned int parks;         /* 停止扫描等待中断的次数 */
+    unsigned int wakeups;       /* 列中断唤醒扫描的次数 */
+    unsigned int events;        /* 进入队列的事件数 */
+    unsigned int drops;         /* 队列满丢弃的事件数 */
+    u64 scan_last_ns;           /* 最近一次扫描耗时 */
+    u64 scan_max_ns;            /* 最长扫描耗时 */
+    u64 scan_total_ns;          /* 扫描总耗时 */
+};
+
+/*
+* 设备结构体，加载驱动时kzalloc分配
+* 扫描定时器、列中断和worker访问的字段从cache line边界开始，注册用的字段另起一行放在后面
+*/
 struct key_dev {
-    dev_t devid;
+    spinlock_t lock;                    /* 保护扫描状态和计数 */
+    bool matrix;
+    bool parked;                        /* 已停止扫描，所有行拉低等待列中断 */
+    bool stopped;                       /* 卸载中，不再启动扫描或打开中断 */
+    bool use_worker;                    /* 在kthread worker中采样 */
+    unsigned int idle_scans;
+    unsigned int scan_us;
+    unsigned int settle_us;
+    u32 raw[MATRIX_MAX_ROWS];           /* 每行上一次扫描到的按下位图 */
+    u32 stable[MATRIX_MAX_ROWS];        /* 每行消抖后的按下位图 */
+    unsigned char debounce_cnt[MATRIX_MAX_ROWS];
+    struct key_scan_stats stats;
+
+    /* 矩阵模式：行输出、列输入上拉，拉低一行读取各列，低电平表示按下 */
+    int nrows;
+    int ncols;
+    int row_gpios[MATRIX_MAX_ROWS];
+    int col_gpios[MATRIX_MAX_COLS];
+    int col_irqs[MATRIX_MAX_COLS];
+
+    /* 轮询模式：key-gpio中每个引脚一个按键，引脚没有中断能力，定时采样，低电平表示按下 */
+    int nkeys;
+    void __iomem *gpio_base;            /* 第一个按键所在GPIO组的寄存器 */
+    u32 key_bits[KEY_MAX_KEYS];         /* 同组按键在PSR中的位，0表示用gpiolib逐个读取 */
+    int key_gpios[KEY_MAX_KEYS];
+
+    struct hrtimer scan_timer;          /* 矩阵扫描或轮询采样的定时器 */
+    struct kthread_worker worker;
+    struct kthread_work poll_work;
+
+    /* 事件队列，扫描或采样是唯一的生产者，读者之间用read_lock互斥 */
+    DECLARE_KFIFO(fifo, unsigned char, KEY_FIFO_SIZE);
+    wait_queue_head_t r_wait;
+
+    /* 注册和初始化时使用 */
+    dev_t devid ____cacheline_aligned;
     struct cdev cdev;
     struct class *class;
     struct device *device;
     int major;
     int minor;
     struct device_node *nd;
-    int key_gpio;
-    atomic_t keyvalue;
-};
+    struct mutex read_lock;
+    bool cansleep;                      /* 有引脚读取时会睡眠(比如I2C扩展芯片) */
+    struct task_struct *worker_task;
+    struct dentry *debugfs;
+} ____cacheline_aligned;
+
+static struct key_dev *key;
+
+static int poll_mode = POLL_TIMER;
+module_param(poll_mode, int, 0444);
+MODULE_PARM_DESC(poll_mode, "polled keys: 0 samples in the hrtimer, 1 in a kthread worker");
+
+/*
+* i.MX的GPIO控制器直接映射寄存器，读PSR就能拿到整组引脚的电平
+* 和第一个i.MX GPIO上的按键同组的按键都从这一次读取中取值
+*/
+static void keybank_init(void)
+{
+    struct of_phandle_args args;
+    struct device_node *bank = NULL;
+    int i;
+
+    for(i = 0; i < key->nkeys; i ++) {
+        if(of_parse_phandle_with_args(key->nd, "key-gpio", "#gpio-cells", i, &args))
+            continue;
+        if(bank == NULL && of_device_is_compatible(args.np, "fsl,imx35-gpio")) {
+            key->gpio_base = of_iomap(args.np, 0);
+            if(key->gpio_base)
+                bank = of_node_get(args.np);
+        }
+        if(bank == args.np && args.args[0] < 32)
+            key->key_bits[i] = BIT(args.args[0]);
+        of_node_put(args.np);
+    }
+    of_node_put(bank);
+}
+
+static void matrix_rows_set(struct key_dev *dev, int value)
+{
+    int r;
+
+    for(r = 0; r < dev->nrows; r ++)
+        gpio_set_value(dev->row_gpios[r], value);
+}
+
+/* 事件入队，调用者持有lock */
+static void key_push(struct key_dev *dev, unsigned char code, bool pressed)
+{
+    if(kfifo_put(&dev->fifo, code | (pressed ? KEY_EV_PRESS : 0)))
+        dev->stats.events ++;
+    else
+        dev->stats.drops ++;
+}
+
+/*
+* 一行的消抖：连续DEBOUNCE_SCANS次扫描结果相同后，和上次的稳定状态比较并上报变化的按键
+* 返回true表示这一行还在抖动或有按键按下，需要继续快速扫描
+*/
+static bool key_debounce_row(struct key_dev *dev, int row, u32 raw, int width)
+{
+    u32 diff;
+    int i;
+
+    if(raw != dev->raw[row]) {
+        dev->raw[row] = raw;
+        dev->debounce_cnt[row] = 0;
+        return true;
+    }
+    if(dev->debounce_cnt[row] < DEBOUNCE_SCANS && ++dev->debounce_cnt[row] < DEBOUNCE_SCANS)
+        return true;
+
+    diff = raw ^ dev->stable[row];
+    dev->stable[row] = raw;
+    for(i = 0; diff; i ++, diff >>= 1) {
+        if(diff & 1)
+            key_push(dev, row * width + i, raw & BIT(i));
+    }
+    return raw != 0;
+}
+
+/* 记录一次扫描或采样的耗时，调用者持有lock */
+static void key_scan_account(struct key_dev *dev, u64 cost)
+{
+    dev->stats.scans ++;
+    dev->stats.scan_last_ns = cost;
+    dev->stats.scan_total_ns += cost;
+    if(cost > dev->stats.scan_max_ns)
+        dev->stats.scan_max_ns = cost;
+}
+
+/* 扫描一遍矩阵，调用者持有lock，返回true表示有按键活动 */
+static bool matrix_scan(struct key_dev *dev)
+{
+    u64 start, cost;
+    u32 raw;
+    bool busy = false;
+    int r, c;
+
+    start = ktime_get_ns();
+    matrix_rows_set(dev, 1);
+    for(r = 0; r < dev->nrows; r ++) {
+        gpio_set_value(dev->row_gpios[r], 0);
+        udelay(dev->settle_us);
+        raw = 0;
+        for(c = 0; c < dev->ncols; c ++) {
+            if(!gpio_get_value(dev->col_gpios[c]))
+                raw |= BIT(c);
+        }
+        gpio_set_value(dev->row_gpios[r], 1);
+        if(key_debounce_row(dev, r, raw, dev->ncols))
+            busy = true;
+    }
+    key_scan_account(dev, ktime_get_ns() - start);
+    return busy;
+}
+
+/*
+* 扫描定时器，有按键活动时每scan_us扫描一次
+* 连续IDLE_SCANS次空闲后拉低所有行、打开列中断并停止定时器，空闲时不占用CPU
+*/
+static enum hrtimer_restart matrix_scan_timer(struct hrtimer *timer)
+{
+    struct key_dev *dev = container_of(timer, struct key_dev, scan_timer);
+    unsigned int events;
+    bool busy;
+    int c;
+
+    spin_lock(&dev->lock);
+    if(dev->stopped) {
+        spin_unlock(&dev->lock);
+        return HRTIMER_NORESTART;
+    }
+
+    events = dev->stats.events;
+    busy = matrix_scan(dev);
+    events = dev->stats.events - events;
+
+    if(busy) {
+        dev->idle_scans = 0;
+    } else if(++dev->idle_scans >= IDLE_SCANS) {
+        matrix_rows_set(dev, 0);
+        dev->parked = true;
+        dev->stats.parks ++;
+        spin_unlock(&dev->lock);
+        for(c = 0; c < dev->ncols; c ++)
+            enable_irq(dev->col_irqs[c]);
+        if(events)
+            wake_up_interruptible(&dev->r_wait);
+        return HRTIMER_NORESTART;
+    }
+    spin_unlock(&dev->lock);
+
+    if(events)
+        wake_up_interruptible(&dev->r_wait);
+    hrtimer_forward_now(timer, ns_to_ktime((u64)dev->scan_us * NSEC_PER_USEC));
+    return HRTIMER_RESTART;
+}
+
+/* 停止扫描期间任意一列被拉低，关闭列中断并立即开始扫描 */
+static irqreturn_t matrix_col_handler(int irq, void *dev_id)
+{
+    struct key_dev *dev = dev_id;
+    int c;
+
+    spin_lock(&dev->lock);
+    if(dev->parked && !dev->stopped) {
+        dev->parked = false;
+        dev->idle_scans = 0;
+        dev->stats.wakeups ++;
+        for(c = 0; c < dev->ncols; c ++)
+            disable_irq_nosync(dev->col_irqs[c]);
+        hrtimer_start(&dev->scan_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+    }
+    spin_unlock(&dev->lock);
+    return IRQ_HANDLED;
+}
+
+static void matrix_exit(void)
+{
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&key->lock, flags);
+    key->stopped = true;
+    spin_unlock_irqrestore(&key->lock, flags);
+    hrtimer_cancel(&key->scan_timer);
+
+    for(i = 0; i < key->ncols; i ++) {
+        if(key->col_irqs[i] > 0)
+            free_irq(key->col_irqs[i], key);
+        gpio_free(key->col_gpios[i]);
+    }
+    for(i = 0; i < key->nrows; i ++)
+        gpio_free(key->row_gpios[i]);
+}
+
+/*
+* 矩阵键盘的设备树节点示例：
+* key {
+*     row-gpios = <&gpio1 1 GPIO_ACTIVE_LOW ...>;
+*     col-gpios = <&gpio1 5 GPIO_ACTIVE_LOW ...>;   列需要上拉
+*     col-scan-delay-us = <5>;                      可选
+*     scan-interval-us = <5000>;                    可选
+* };
+* 扫描在hrtimer回调中进行，所以行列GPIO必须是不会睡眠的
+*/
+static int matrix_init(int nrows, int ncols)
+{
+    int i, gpio, irq, ret;
+
+    if(nrows > MATRIX_MAX_ROWS || ncols > MATRIX_MAX_COLS) {
+        printk("matrix %dx%d too large!\r\n", nrows, ncols);
+        return -EINVAL;
+    }
+
+    key->settle_us = SETTLE_US_DEF;
+    key->scan_us = SCAN_US_DEF;
+    of_property_read_u32(key->nd, "col-scan-delay-us", &key->settle_us);
+    of_property_read_u32(key->nd, "scan-interval-us", &key->scan_us);
+    if(key->scan_us < 100)
+        key->scan_us = 100;
+
+    hrtimer_init(&key->scan_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    key->scan_timer.function = matrix_scan_timer;
+
+    for(i = 0; i < nrows; i ++) {
+        gpio = of_get_named_gpio(key->nd, "row-gpios", i);
+        if(gpio < 0 || gpio_request(gpio, "keyrow")) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        key->row_gpios[key->nrows ++] = gpio;
+        gpio_direction_output(gpio, 1);
+        if(gpio_cansleep(gpio)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    for(i = 0; i < ncols; i ++) {
+        gpio = of_get_named_gpio(key->nd, "col-gpios", i);
+        if(gpio < 0 || gpio_request(gpio, "keycol")) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        key->col_irqs[key->ncols] = 0;
+        key->col_gpios[key->ncols ++] = gpio;
+        gpio_direction_input(gpio);
+        irq = gpio_to_irq(gpio);
+        if(gpio_cansleep(gpio) || irq < 0) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        /* 列中断只在停止扫描时打开 */
+        irq_set_status_flags(irq, IRQ_NOAUTOEN);
+        ret = request_irq(irq, matrix_col_handler, IRQF_TRIGGER_FALLING, "keycol", key);
+        if(ret < 0)
+            goto fail;
+        key->col_irqs[i] = irq;
+    }
+
+    key->matrix = true;
+    hrtimer_start(&key->scan_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+    printk("matrix %dx%d, scan %uus\r\n", nrows, ncols, key->scan_us);
+    return 0;
+
+fail:
+    printk("matrix gpio init failed!\r\n");
+    matrix_exit();
+    key->nrows = key->ncols = 0;
+    return ret;
+}
+
+/*
+* 轮询模式采样一次所有按键
+* 同组按键只读一次PSR，其余引脚逐个读取，cansleep为true时在kthread中调用，可以睡眠
+*/
+static void key_poll_once(struct key_dev *dev, bool cansleep)
+{
+    unsigned long flags;
+    unsigned int events;
+    u32 psr = 0, raw = 0;
+    u64 start;
+    int i, v;
+
+    start = ktime_get_ns();
+    if(dev->gpio_base)
+        psr = readl(dev->gpio_base + GPIO_PSR);
+    for(i = 0; i < dev->nkeys; i ++) {
+        if(dev->key_bits[i])
+            v = psr & dev->key_bits[i];
+        else if(cansleep)
+            v = gpio_get_value_cansleep(dev->key_gpios[i]);
+        else
+            v = gpio_get_value(dev->key_gpios[i]);
+        if(!v)
+            raw |= BIT(i);
+    }
+
+    /* 和矩阵共用消抖，所有按键看成第0行 */
+    spin_lock_irqsave(&dev->lock, flags);
+    events = dev->stats.events;
+    key_debounce_row(dev, 0, raw, dev->nkeys);
+    key_scan_account(dev, ktime_get_ns() - start);
+    events = dev->stats.events - events;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if(events)
+        wake_up_interruptible(&dev->r_wait);
+}
+
+static void key_poll_work(struct kthread_work *work)
+{
+    struct key_dev *dev = container_of(work, struct key_dev, poll_work);
+
+    key_poll_once(dev, true);
+}
+
+/*
+* 轮询定时器，每scan_us采样一次
+* worker模式只负责唤醒worker，worker还没处理完上一次时这一次自然合并
+*/
+static enum hrtimer_restart key_poll_timer(struct hrtimer *timer)
+{
+    struct key_dev *dev = container_of(timer, struct key_dev, scan_timer);
+
+    if(ACCESS_ONCE(dev->stopped))
+        return HRTIMER_NORESTART;
+
+    if(dev->use_worker)
+        queue_kthread_work(&dev->worker, &dev->poll_work);
+    else
+        key_poll_once(dev, false);
+
+    hrtimer_forward_now(timer, ns_to_ktime((u64)dev->scan_us * NSEC_PER_USEC));
+    return HRTIMER_RESTART;
+}
+
+static void poll_exit(void)
+{
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&key->lock, flags);
+    key->stopped = true;
+    spin_unlock_irqrestore(&key->lock, flags);
+    hrtimer_cancel(&key->scan_timer);
+
+    if(key->worker_task) {
+        flush_kthread_worker(&key->worker);
+        kthread_stop(key->worker_task);
+    }
+    for(i = 0; i < key->nkeys; i ++)
+        gpio_free(key->key_gpios[i]);
+}
+
+/*
+* 轮询模式，用于没有中断能力的引脚，比如GPIO扩展芯片上的按键
+* key {
+*     key-gpio = <&gpio1 18 GPIO_ACTIVE_LOW>, <&pcf8574 0 GPIO_ACTIVE_LOW>;
+*     poll-interval-us = <5000>;        可选
+* };
+* 有引脚读取会睡眠时强制在kthread worker中采样
+*/
+static int poll_init(int nkeys)
+{
+    int i, gpio, ret;
+
+    if(nkeys > KEY_MAX_KEYS) {
+        printk("too many keys!\r\n");
+        return -EINVAL;
+    }
+
+    key->scan_us = SCAN_US_DEF;
+    of_property_read_u32(key->nd, "poll-interval-us", &key->scan_us);
+    if(key->scan_us < 100)
+        key->scan_us = 100;
+
+    hrtimer_init(&key->scan_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    key->scan_timer.function = key_poll_timer;
+
+    for(i = 0; i < nkeys; i ++) {
+        gpio = of_get_named_gpio(key->nd, "key-gpio", i);
+        if(gpio < 0 || gpio_request(gpio, "key")) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        key->key_gpios[key->nkeys ++] = gpio;
+        gpio_direction_input(gpio);
+        if(gpio_cansleep(gpio))
+            key->cansleep = true;
+        printk("key-gpio num = %d\r\n", gpio);
+    }
+    keybank_init();
+
+    key->use_worker = poll_mode == POLL_WORKER || key->cansleep;
+    if(key->use_worker) {
+        init_kthread_worker(&key->worker);
+        init_kthread_work(&key->poll_work, key_poll_work);
+        key->worker_task = kthread_run(kthread_worker_fn, &key->worker, "keypoll");
+        if(IS_ERR(key->worker_task)) {
+            ret = PTR_ERR(key->worker_task);
+            key->worker_task = NULL;
+            goto fail;
+        }
+    }
+
+    hrtimer_start(&key->scan_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+    printk("%d polled key(s), %uus, %s\r\n", key->nkeys, key->scan_us,
+           key->use_worker ? "worker" : "hrtimer");
+    return 0;
 
-struct key_dev key;
+fail:
+    printk("key gpio init failed!\r\n");
+    poll_exit();
+    key->nkeys = 0;
+    return ret;
+}
 
 static int keyio_init(void)
 {
-    key.nd = of_find_node_by_path("/key");
-    if(key.nd == NULL) {
+    int nrows, ncols, nkeys;
+
+    key->nd = of_find_node_by_path("/key");
+    if(key->nd == NULL) {
         printk("can't find node!\r\n");
         return -EINVAL;
     }
     printk("node has been found!\r\n");
 
-    /* 对于1个gpio的外设来说,index=0 */
-    key.key_gpio = of_get_named_gpio(key.nd, "key-gpio", 0);
-    if(key.key_gpio < 0) {
+    nrows = of_gpio_named_count(key->nd, "row-gpios");
+    ncols = of_gpio_named_count(key->nd, "col-gpios");
+    if(nrows > 0 && ncols > 0)
+        return matrix_init(nrows, ncols);
+
+    nkeys = of_gpio_named_count(key->nd, "key-gpio");
+    if(nkeys <= 0) {
         printk("can't get key-gpio!\r\n");
         return -EINVAL;
     }
-    printk("key-gpio num = %d\r\n", key.key_gpio);
-
-    gpio_request(key.key_gpio, "key0");
-    gpio_direction_input(key.key_gpio);
-
-    return 0;
+    return poll_init(nkeys);
 }
 
 static int key_open(struct inode *inode, struct file *filp)
 {
-    int ret;
-
     /* private_data是地址型数据 */
-    filp->private_data = &key;
+    filp->private_data = key;
 
-    ret = keyio_init();
-    if(ret < 0) {
-        return ret;
-    }
+    /* 按键在加载驱动时已经初始化 */
+    if(!key->matrix && key->nkeys == 0)
+        return -ENODEV;
 
     return 0;
 }
 
+/* 队列为空时阻塞，一次读出多个事件字节 */
 static ssize_t key_read(struct file *filp, char __user *buf, size_t cnt, loff_t *offt)
 {
     int ret;
-    unsigned char value;
+    unsigned int copied;
     struct key_dev *dev = filp->private_data;
 
-    /* 从dev.key_gpio这个id号中读取值 */
-    if(gpio_get_value(dev->key_gpio) == 0) {
-        while(!gpio_get_value(dev->key_gpio));
-        atomic_set(&dev->keyvalue, KEY0VALUE);
-    } else {
-        atomic_set(&dev->keyvalue, INVAKEY);
+    if(kfifo_is_empty(&dev->fifo)) {
+        if(filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(dev->r_wait, !kfifo_is_empty(&dev->fifo));
+        if(ret)
+            return ret;
     }
 
-    value = atomic_read(&dev->keyvalue);
-    ret = copy_to_user(buf, &value, sizeof(value));
+    mutex_lock(&dev->read_lock);
+    ret = kfifo_to_user(&dev->fifo, buf, cnt, &copied);
+    mutex_unlock(&dev->read_lock);
 
-    return ret;
+    return ret ? ret : copied;
 }
 
+static unsigned int key_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct key_dev *dev = filp->private_data;
+
+    poll_wait(filp, &dev->r_wait, wait);
+    if(!kfifo_is_empty(&dev->fifo))
+        return POLLIN | POLLRDNORM;
+    return 0;
+}
+
+/* debugfs: cat查看扫描计数和每次扫描的CPU耗时，写入任意内容清零 */
+static int key_stats_show(struct seq_file *m, void *v)
+{
+    struct key_dev *dev = m->private;
+    struct key_scan_stats stats;
+    unsigned long flags;
+    bool parked;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    stats = dev->stats;
+    parked = dev->parked;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if(dev->matrix)
+        seq_printf(m, "matrix: %dx%d\nscan_us: %u\nstate: %s\n",
+                   dev->nrows, dev->ncols, dev->scan_us, parked ? "parked" : "scanning");
+    else
+        seq_printf(m, "polled: %d\nscan_us: %u\nsampler: %s\n",
+                   dev->nkeys, dev->scan_us, dev->use_worker ? "worker" : "hrtimer");
+    seq_printf(m, "scans: %u\nparks: %u\nwakeups: %u\nevents: %u\ndrops: %u\n",
+               stats.scans, stats.parks, stats.wakeups, stats.events, stats.drops);
+    seq_printf(m, "scan_last: %lluns\nscan_avg: %lluns\nscan_max: %lluns\n",
+               stats.scan_last_ns,
+               stats.scans ? div_u64(stats.scan_total_ns, stats.scans) : 0,
+               stats.scan_max_ns);
+    return 0;
+}
+
+static int key_stats_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, key_stats_show, inode->i_private);
+}
+
+static ssize_t key_stats_write(struct file *filp, const char __user *buf, size_t cnt, loff_t *offt)
+{
+    struct key_dev *dev = ((struct seq_file *)filp->private_data)->private;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return cnt;
+}
+
+static const struct file_operations key_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = key_stats_open,
+    .read = seq_read,
+    .write = key_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
 /* 设备操作函数 */
 static struct file_operations key_fops = {
     .owner = THIS_MODULE,
     .open = key_open,
     .read = key_read,
+    .poll = key_poll,
 };
 
 static int __init mykey_init(void)
 {
-    /* 初始化原子变量 */
-    atomic_set(&key.keyvalue, INVAKEY);
+    key = kzalloc(sizeof(*key), GFP_KERNEL);
+    if(key == NULL)
+        return -ENOMEM;
+
+    spin_lock_init(&key->lock);
+    INIT_KFIFO(key->fifo);
+    init_waitqueue_head(&key->r_wait);
+    mutex_init(&key->read_lock);
 
     /* 注册字符设备驱动 */
-    if(key.major) {
-        key.devid = MKDEV(key.major, 0);
-        register_chrdev_region(key.devid, KEY_CNT, KEY_NAME);
+    if(key->major) {
+        key->devid = MKDEV(key->major, 0);
+        register_chrdev_region(key->devid, KEY_CNT, KEY_NAME);
     } else {
-        alloc_chrdev_region(&key.devid, 0, KEY_CNT, KEY_NAME);
-        key.major = MAJOR(key.devid);
-        key.minor = MINOR(key.devid);
+        alloc_chrdev_region(&key->devid, 0, KEY_CNT, KEY_NAME);
+        key->major = MAJOR(key->devid);
+        key->minor = MINOR(key->devid);
     }
-    printk("major=%d, minor=%d\r\n", key.major, key.minor);
+    printk("major=%d, minor=%d\r\n", key->major, key->minor);
 
-    key.cdev.owner = THIS_MODULE;
-    cdev_init(&key.cdev, &key_fops);
+    key->cdev.owner = THIS_MODULE;
+    cdev_init(&key->cdev, &key_fops);
 
-    cdev_add(&key.cdev, key.devid, KEY_CNT);
+    cdev_add(&key->cdev, key->devid, KEY_CNT);
+
+    key->class = class_create(THIS_MODULE, KEY_NAME);
+    if(IS_ERR(key->class)) {
+        return PTR_ERR(key->class);
+    }
 
-    key.class = class_create(THIS_MODULE, KEY_NAME);
-    if(IS_ERR(key.class)) {
-        return PTR_ERR(key.class);
+    key->device = device_create(key->class, NULL, key->devid, NULL, KEY_NAME);
+    if(IS_ERR(key->device)) {
+        return PTR_ERR(key->device);
     }
 
-    key.device = device_create(key.class, NULL, key.devid, NULL, KEY_NAME);
-    if(IS_ERR(key.device)) {
-        return PTR_ERR(key.device);
+    /* 设备树中有row-gpios和col-gpios时为矩阵模式，否则轮询key-gpio，加载时就开始扫描 */
+    if(keyio_init() == 0) {
+        /* /sys/kernel/debug/key/stats，没有使能debugfs时忽略 */
+        key->debugfs = debugfs_create_dir(KEY_NAME, NULL);
+        if(!IS_ERR_OR_NULL(key->debugfs))
+            debugfs_create_file("stats", 0644, key->debugfs, key, &key_stats_fops);
     }
 
     return 0;
@@ -136,11 +705,18 @@ static int __init mykey_init(void)
 
 static void __exit mykey_exit(void)
 {
-    gpio_free(key.key_gpio);
-    device_destroy(key.class, key.devid);
-    class_destroy(key.class);
-    cdev_del(&key.cdev);
-    unregister_chrdev_region(key.devid, KEY_CNT);
+    debugfs_remove_recursive(key->debugfs);
+    if(key->matrix)
+        matrix_exit();
+    else if(key->nkeys)
+        poll_exit();
+    if(key->gpio_base)
+        iounmap(key->gpio_base);
+    device_destroy(key->class, key->devid);
+    class_destroy(key->class);
+    cdev_del(&key->cdev);
+    unregister_chrdev_region(key->devid, KEY_CNT);
+    kfree(key);
 }
 
 module_init(mykey_init);
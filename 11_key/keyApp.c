@@ -6,8 +6,7 @@
 #include "stdlib.h"
 #include "string.h"
 
-#define KEY0VALUE   0XF0
-#define INVAKEY     0X00
+#define KEY_EV_PRESS 0X80   /* 事件字节最高位表示按下，低7位为按键编号 */
 
 int main(int argc, char *argv[])
 {
@@ -29,10 +28,12 @@ int main(int argc, char *argv[])
     }
 
     while(1) {
-        read(fd, &keyvalue, sizeof(keyvalue));
-        if(keyvalue == KEY0VALUE) {
-            printf("key0 pressed, value=%#X!\r\n", keyvalue);
-        }
+        /* 没有事件时read阻塞 */
+        ret = read(fd, &keyvalue, sizeof(keyvalue));
+        if(ret < 0)
+            break;
+        printf("key%d %s\r\n", keyvalue & ~KEY_EV_PRESS,
+               (keyvalue & KEY_EV_PRESS) ? "pressed" : "released");
     }
 
     ret = close(fd);
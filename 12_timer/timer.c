@@ -12,193 +12,1532 @@
 #include <linux/of_address.h>
 #include <linux/of_gpio.h>
 #include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
 #include <linux/semaphore.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/math64.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/mach/map.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
 
-#define TIMER_CNT   1
+#define TIMER_CNT   4           /* 最多几个实例，每个实例一个次设备号 */
 #define TIMER_NAME  "timerdev"
 #define CLOSE_CMD   (_IO(0XEF, 0X1))
 #define OPEN_CMD    (_IO(0XEF, 0X2))
-#define SETPERIOD_CMD   (_IO(0XEF, 0X3))
+#define SETPERIOD_CMD   (_IO(0XEF, 0X3))    /* 周期单位ms，使用jiffies定时器 */
+#define SETPERIOD_US_CMD    (_IO(0XEF, 0X4))    /* 周期单位us，使用高精度定时器 */
+#define TIMER_MIN_US    20      /* 高精度定时器的最小周期，太小会占满CPU */
+#define GETSTATS_CMD    (_IOR(0XEF, 0X5, struct timer_stats))
+#define SETCHAN_CMD     (_IOW(0XEF, 0X6, struct timer_chan))
+#define GETCHANSTATS_CMD    (_IOR(0XEF, 0X7, struct timer_chan_stats))
+#define TIMER_MAX_CHANNELS  64  /* 多通道模式最多的输出数 */
+#define SETOUTPUT_CMD   (_IO(0XEF, 0X8))    /* 参数为led-gpio中的下标，-1表示不驱动输出 */
+#define TIMER_MAX_OUTPUTS   8   /* led-gpio最多几个输出 */
+#define SETPRIO_CMD     (_IO(0XEF, 0X9))    /* 参数为实例worker线程的SCHED_FIFO优先级 */
+#define SETWORKER_CMD   (_IO(0XEF, 0XA))    /* 参数为1时翻转交给worker线程，0时在定时器回调中翻转 */
+#define BATCH_CMD       (_IOW(0XEF, 0XB, struct timer_batch))
+#define TIMER_BATCH_MAX 64      /* 一次批量提交最多的命令数 */
+#define WATCH_CMD       (_IO(0XEF, 0XC))    /* read/poll跟随的到期来源，参数为输出下标，-1为本文件的定时器 */
+#define TESTMODE_CMD    (_IO(0XEF, 0XD))    /* 参数为1时清零并开始记录每次到期的延迟，0时停止记录 */
+#define GETHIST_CMD     (_IOR(0XEF, 0XE, struct timer_hist))
+#define TIMER_HIST_BUCKETS  1000    /* 延迟直方图每格1us，超出的计入overflow */
+#define SETSLACK_CMD    (_IO(0XEF, 0XF))    /* 参数为允许推迟到期的时间(us)，0为严格模式 */
+#define TIMER_DEFER_SLACK_US    100000  /* slack达到100ms时jiffies定时器改为deferrable，CPU空闲时不单独唤醒 */
+#define TIMER_SLACK_MAX_US      1000000 /* slack上限1s，换算成ns后32位的unsigned long也放得下 */
 #define LEDON       1
 #define LEDOFF      0
 
+/* GETSTATS_CMD返回本文件定时器的统计，OPEN_CMD时清零 */
+struct timer_stats {
+    __u64 ticks;                /* 到期次数 */
+    __u64 overruns;             /* 回调来得太晚而跳过的周期数 */
+    __u64 last_late_ns;         /* 最近一次相对理想到期时间的延迟 */
+    __u64 max_late_ns;          /* 最大延迟 */
+    /* 以下只在worker模式下统计:从定时器到期到worker写完GPIO的时间 */
+    __u64 work_toggles;         /* worker完成的翻转次数 */
+    __u64 work_dropped;         /* 上一次还没处理完又到期，合并掉的翻转次数 */
+    __u64 last_toggle_ns;
+    __u64 max_toggle_ns;
+    __u64 avg_toggle_ns;
+    /*
+    * 回调分为两类，用来比较slack和严格模式，两者之和等于ticks
+    * 高精度定时器在范围的末尾之前运行，说明是别的唤醒顺带处理的
+    * jiffies定时器只能判断deferrable定时器是否因为CPU空闲被推迟，普通定时器都算自己的唤醒
+    */
+    __u64 coalesced;            /* 和其他唤醒合并的回调次数 */
+    __u64 wakeups;              /* 自己唤醒CPU的回调次数 */
+    __u64 elapsed_ns;           /* OPEN_CMD之后经过的时间 */
+    __u64 wakeups_mps;          /* wakeups每秒的次数x1000 */
+};
+
+/* GETHIST_CMD返回测试模式下的延迟统计，延迟为实际到期时间减理想到期时间 */
+struct timer_hist {
+    __u64 samples;
+    __u64 min_ns;
+    __u64 avg_ns;
+    __u64 max_ns;
+    __u64 overflow;             /* 超过TIMER_HIST_BUCKETS us的次数 */
+    __u32 buckets[TIMER_HIST_BUCKETS];
+};
+
+/*
+* BATCH_CMD中的一条命令，op为单个ioctl的命令码
+* 支持CLOSE_CMD、OPEN_CMD、SETPERIOD_CMD、SETPERIOD_US_CMD、SETOUTPUT_CMD、SETWORKER_CMD、WATCH_CMD、
+* TESTMODE_CMD、SETSLACK_CMD，
+* 以及GETSTATS_CMD作为查询，到期次数放在value中
+*/
+struct timer_cmd {
+    __u32 op;
+    __u32 arg;
+    __s32 result;               /* 这条命令的返回值 */
+    __u32 pad;
+    __u64 value;
+};
+
+/* BATCH_CMD的参数，cmds指向count条timer_cmd，结果写回原处 */
+struct timer_batch {
+    __u64 cmds;
+    __u32 count;
+    __u32 pad;
+};
+
+/* SETCHAN_CMD的参数，period_us为0时停止该通道 */
+struct timer_chan {
+    __u32 chan;                 /* 通道号，对应设备树channel-gpios中的下标 */
+    __u32 period_us;            /* 翻转周期(us) */
+};
+
+/* GETCHANSTATS_CMD返回的多通道统计 */
+struct timer_chan_stats {
+    __u32 channels;             /* 通道总数 */
+    __u32 active;               /* 正在运行的通道数 */
+    __u64 wakeups;              /* 调度定时器的到期次数 */
+    __u64 toggles;              /* 所有通道翻转的总次数 */
+    __u64 overruns;             /* 所有通道错过的周期数 */
+};
+
+/* 多通道模式的一个输出，按next_ns放在最小堆中 */
+struct timer_channel {
+    int gpio;
+    int sta;
+    int idx;                    /* 在堆中的下标，-1表示没有运行 */
+    u64 period_ns;
+    u64 next_ns;                /* 下一次翻转的时间，CLOCK_MONOTONIC */
+};
+
+/*
+* 定时器配置，修改时复制一份改好后用RCU发布，旧的在宽限期后释放
+* 定时器回调只需要rcu_read_lock读取，不用加锁也不用关中断
+*/
+struct timer_cfg {
+    int timeperiod;             /* 定时周期(ms) */
+    unsigned int period_us;     /* 高精度定时器的周期(us) */
+    bool hr;                    /* 当前使用高精度定时器 */
+    unsigned int slack_us;      /* 到期可以推迟的时间，和系统中其他唤醒合并 */
+    struct rcu_head rcu;
+};
+
+/* 测试模式下每个文件的延迟统计，第一次打开测试模式时分配，release时释放 */
+struct timer_lat {
+    u64 samples;
+    u64 min_ns;
+    u64 max_ns;
+    u64 sum_ns;
+    u64 overflow;
+    u32 buckets[TIMER_HIST_BUCKETS];
+};
+
+/*
+* 到期计数和等待它的read/poll，每个文件和每个输出各一个
+* 到期时只唤醒计数前进的那个等待队列，其他文件的读者不受影响
+*/
+struct timer_ticks {
+    atomic64_t count;
+    wait_queue_head_t wait;
+};
+
+/* 设备树led-gpio中的一个输出，同一时间只能被一个打开的文件占用 */
+struct timer_output {
+    int gpio;
+    struct timer_ctx *owner;
+    struct timer_ticks ticks;   /* 驱动这个输出的定时器累计的到期次数，换了占用者也继续累加 */
+};
+
+/*
+* 每个打开的文件一个，open时kzalloc分配，release时释放
+* 不同的进程各自有自己的定时器、周期和输出，互不影响
+* 定时器回调访问的字段放在开头，ioctl用的字段另起一个cache line
+*/
+struct timer_ctx {
+    struct timer_list timer;    /* 定义一个定时器 */
+    struct timer_list dtimer;   /* deferrable定时器，slack很大时代替timer */
+    struct timer_list *jtimer;  /* 当前使用的jiffies定时器，只在定时器停止时修改 */
+    unsigned long jnext;        /* jiffies定时器的理想到期时间，slack会推迟实际的expires */
+    struct hrtimer hrtimer;     /* 高精度定时器，用于亚毫秒周期 */
+    struct timer_cfg __rcu *cfg;
+    struct timer_dev *dev;
+    int gpio;                   /* 驱动的GPIO，-1表示不驱动输出，只在定时器停止时修改 */
+    int out;                    /* 占用的输出下标，-1表示没有，和gpio一起修改 */
+    int sta;                    /* led当前状态 */
+    bool offload;               /* 翻转交给worker线程，同样只在定时器停止时修改 */
+    seqcount_t stats_seq;       /* 只有正在运行的定时器回调写stats，读者用seqcount重试 */
+    struct timer_stats stats;
+    struct timer_ticks ticks;   /* 本文件定时器累计的到期次数，不随OPEN_CMD清零 */
+    u64 start_ns;               /* 统计开始的时间，和stats一起由stats_seq保护 */
+    bool testing;               /* 测试模式，每次到期记录到lat中 */
+    struct timer_lat *lat;      /* 和stats一样由stats_seq保护 */
+
+    /* worker模式:回调只记录时间并排队，worker线程用gpio_set_value_cansleep翻转 */
+    struct kthread_work work;
+    u64 queued_ns;
+    seqcount_t work_seq;        /* worker的延迟统计只有worker线程写 */
+    u64 toggle_sum_ns;
+
+    struct mutex cfg_lock ____cacheline_aligned;    /* 串行化配置的修改和定时器的启停 */
+    bool running;               /* 定时器已经启动，切换输出后要重新启动 */
+    bool want_worker;           /* SETWORKER_CMD设置的模式，输出会睡眠时无论如何都用worker */
+
+    /* 和timerfd一样，read返回上次read之后的到期次数 */
+    struct timer_ticks *watch;  /* 跟随的计数，本文件的ticks或某个输出的ticks */
+    atomic64_t cursor;          /* 上次read时watch的值 */
+
+    struct list_head node;      /* 挂在实例的ctxs上，debugfs列出所有打开的文件 */
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+};
+
+/*
+* 每个实例一个，加载驱动时kzalloc分配
+* 定时器回调访问的字段放在开头，注册用的字段另起一个cache line
+*/
 struct timer_dev {
+    /*
+    * 多通道模式：所有通道共用一个高精度定时器，总是按最早的到期时间设置
+    * 堆只在chan_timer停止时由ioctl修改，回调中不用加锁
+    */
+    struct hrtimer chan_timer;
+    struct timer_channel **heap;
+    int heap_n;
+    seqcount_t chan_seq;
+    struct timer_chan_stats chan_stats;
+
+    /* 每个文件的定时器回调也会访问:累加输出的计数并唤醒它的等待者、排队给worker */
+    struct timer_output *outputs;
+    struct kthread_worker worker;   /* 实例的翻转线程，SCHED_FIFO */
+
+    struct mutex lock ____cacheline_aligned;    /* 保护输出的归属和多通道的堆 */
+    int noutputs;
+    struct list_head ctxs;          /* 打开的文件，由lock保护 */
+    struct task_struct *worker_task;
     dev_t devid;
     struct cdev cdev;
-    struct class *class;
     struct device *device;
-    int major;
-    int minor;
     struct device_node *nd;
-    int led_gpio;
-    int timeperiod;             /* 定时周期 */
-    struct timer_list timer;    /* 定义一个定时器 */
-    spinlock_t lock;            /* 定义自旋锁 */
-};
+    struct timer_channel *channels;
+    int nchannels;
+} ____cacheline_aligned;
+
+/* 所有实例共用的主设备号和类 */
+static dev_t timer_devid;
+static int timer_major;
+static struct class *timer_class;
+static struct timer_dev *timerdevs[TIMER_CNT];
+static struct dentry *timer_debugfs;
+
+/* 每个实例对应的led设备树节点，第0个实例为/dev/timerdev，之后为/dev/timerdev1... */
+static char *nodes[TIMER_CNT] = { "/gpioled" };
+static int nodes_num = 1;
+module_param_array(nodes, charp, &nodes_num, 0444);
+MODULE_PARM_DESC(nodes, "device tree paths of the leds, one timer instance each");
 
-struct timer_dev timerdev;
+/* worker线程的初始实时优先级，之后可以用SETPRIO_CMD修改 */
+static int worker_prio = 50;
+module_param(worker_prio, int, 0444);
+MODULE_PARM_DESC(worker_prio, "SCHED_FIFO priority of the toggle workers (1-99)");
 
-/* 初始化led灯的IO，在open()函数打开驱动时调用 */
-/* 从设备数获取信息，然后初始化相应的IO */
-static int led_init(void)
+/* 初始化led灯的IO，在加载驱动创建实例时调用 */
+/* 从设备数获取信息，led-gpio可以列出多个输出，由打开的文件分别占用 */
+static int led_init(struct timer_dev *dev, const char *path)
 {
-    int ret;
+    int i, n, gpio, ret;
 
-    timerdev.nd = of_find_node_by_path("/gpioled");
-    if(timerdev.nd == NULL) {
-        printk("can't find node!\r\n");
+    dev->nd = of_find_node_by_path(path);
+    if(dev->nd == NULL) {
+        printk("can't find node %s!\r\n", path);
         return -EINVAL;
     }
 
-    timerdev.led_gpio = of_get_named_gpio(timerdev.nd, "led-gpio", 0);
-    if(timerdev.led_gpio < 0) {
+    n = of_gpio_named_count(dev->nd, "led-gpio");
+    if(n <= 0) {
         printk("can't find led-gpio!\r\n");
         return -EINVAL;
     }
+    if(n > TIMER_MAX_OUTPUTS)
+        n = TIMER_MAX_OUTPUTS;
 
-    gpio_request(timerdev.led_gpio, "led");
-    ret = gpio_direction_output(timerdev.led_gpio, 1);
-    if(ret < 0) {
-        printk("can't set direction!\r\n");
+    dev->outputs = kcalloc(n, sizeof(*dev->outputs), GFP_KERNEL);
+    if(dev->outputs == NULL)
+        return -ENOMEM;
+
+    for(i = 0; i < n; i ++) {
+        gpio = of_get_named_gpio(dev->nd, "led-gpio", i);
+        if(gpio < 0) {
+            printk("can't find led-gpio %d!\r\n", i);
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = gpio_request(gpio, "led");
+        if(ret < 0) {
+            printk("can't request led-gpio %d!\r\n", i);
+            goto fail;
+        }
+        ret = gpio_direction_output(gpio, 1);
+        if(ret < 0) {
+            printk("can't set direction!\r\n");
+            gpio_free(gpio);
+            goto fail;
+        }
+        dev->outputs[i].gpio = gpio;
+        atomic64_set(&dev->outputs[i].ticks.count, 0);
+        init_waitqueue_head(&dev->outputs[i].ticks.wait);
+        dev->noutputs ++;
+    }
+
+    return 0;
+
+fail:
+    for(i = 0; i < dev->noutputs; i ++)
+        gpio_free(dev->outputs[i].gpio);
+    dev->noutputs = 0;
+    kfree(dev->outputs);
+    return ret;
+}
+
+/* 所有文件都已关闭，输出没有人占用 */
+static void led_exit(struct timer_dev *dev)
+{
+    int i;
+
+    for(i = 0; i < dev->noutputs; i ++) {
+        gpio_set_value_cansleep(dev->outputs[i].gpio, 1);
+        gpio_free(dev->outputs[i].gpio);
+    }
+    kfree(dev->outputs);
+}
+
+/* 多通道的最小堆，按next_ns排序 */
+static void chan_heap_swap(struct timer_dev *dev, int a, int b)
+{
+    struct timer_channel *t = dev->heap[a];
+
+    dev->heap[a] = dev->heap[b];
+    dev->heap[b] = t;
+    dev->heap[a]->idx = a;
+    dev->heap[b]->idx = b;
+}
+
+static void chan_heap_up(struct timer_dev *dev, int i)
+{
+    int parent;
+
+    while(i > 0) {
+        parent = (i - 1) / 2;
+        if(dev->heap[parent]->next_ns <= dev->heap[i]->next_ns)
+            break;
+        chan_heap_swap(dev, i, parent);
+        i = parent;
+    }
+}
+
+static void chan_heap_down(struct timer_dev *dev, int i)
+{
+    int child;
+
+    while((child = 2 * i + 1) < dev->heap_n) {
+        if(child + 1 < dev->heap_n && dev->heap[child + 1]->next_ns < dev->heap[child]->next_ns)
+            child ++;
+        if(dev->heap[i]->next_ns <= dev->heap[child]->next_ns)
+            break;
+        chan_heap_swap(dev, i, child);
+        i = child;
+    }
+}
+
+static void chan_heap_add(struct timer_dev *dev, struct timer_channel *ch)
+{
+    ch->idx = dev->heap_n;
+    dev->heap[dev->heap_n ++] = ch;
+    chan_heap_up(dev, ch->idx);
+}
+
+static void chan_heap_del(struct timer_dev *dev, struct timer_channel *ch)
+{
+    int i = ch->idx;
+
+    ch->idx = -1;
+    dev->heap_n --;
+    if(i == dev->heap_n)
+        return;
+    dev->heap[i] = dev->heap[dev->heap_n];
+    dev->heap[i]->idx = i;
+    chan_heap_up(dev, i);
+    chan_heap_down(dev, dev->heap[i]->idx);
+}
+
+/*
+* 调度定时器回调，在硬中断中执行
+* 一次处理所有已经到期的通道，然后按堆顶重新设置到期时间
+*/
+static enum hrtimer_restart timer_chan_function(struct hrtimer *timer)
+{
+    struct timer_dev *dev = container_of(timer, struct timer_dev, chan_timer);
+    struct timer_channel *ch;
+    u64 now = ktime_to_ns(ktime_get());
+    u64 missed, toggles = 0, overruns = 0;
+
+    while(dev->heap_n && dev->heap[0]->next_ns <= now) {
+        ch = dev->heap[0];
+        ch->sta = !ch->sta;
+        gpio_set_value(ch->gpio, ch->sta);
+        toggles ++;
+
+        /* 和单通道一样从理想时间推进，错过的周期跳过 */
+        ch->next_ns += ch->period_ns;
+        if(ch->next_ns <= now) {
+            missed = div64_u64(now - ch->next_ns, ch->period_ns) + 1;
+            ch->next_ns += missed * ch->period_ns;
+            overruns += missed;
+        }
+        chan_heap_down(dev, 0);
+    }
+
+    write_seqcount_begin(&dev->chan_seq);
+    dev->chan_stats.wakeups ++;
+    dev->chan_stats.toggles += toggles;
+    dev->chan_stats.overruns += overruns;
+    write_seqcount_end(&dev->chan_seq);
+
+    if(dev->heap_n == 0)
+        return HRTIMER_NORESTART;
+    hrtimer_set_expires(timer, ns_to_ktime(dev->heap[0]->next_ns));
+    return HRTIMER_RESTART;
+}
+
+/* 设置一个通道的周期，调用者持有dev->lock */
+static int timer_chan_set(struct timer_dev *dev, const struct timer_chan *chan)
+{
+    struct timer_channel *ch;
+
+    if(chan->chan >= dev->nchannels)
         return -EINVAL;
+    if(chan->period_us && chan->period_us < TIMER_MIN_US)
+        return -EINVAL;
+
+    /* 停下调度定时器后堆只有我们在访问，其他通道的到期时间不变，不会因此漂移 */
+    hrtimer_cancel(&dev->chan_timer);
+    ch = &dev->channels[chan->chan];
+    if(ch->idx >= 0)
+        chan_heap_del(dev, ch);
+    if(chan->period_us) {
+        ch->period_ns = (u64)chan->period_us * NSEC_PER_USEC;
+        ch->next_ns = ktime_to_ns(ktime_get()) + ch->period_ns;
+        chan_heap_add(dev, ch);
+    }
+    if(dev->heap_n)
+        hrtimer_start(&dev->chan_timer, ns_to_ktime(dev->heap[0]->next_ns), HRTIMER_MODE_ABS);
+    return 0;
+}
+
+/*
+* 多通道模式的输出来自设备树的channel-gpios，没有这个属性时通道数为0
+* 翻转在硬中断中进行，不支持会睡眠的GPIO
+*/
+static int chan_init(struct timer_dev *dev)
+{
+    int i, n, gpio, ret;
+
+    n = of_gpio_named_count(dev->nd, "channel-gpios");
+    if(n <= 0)
+        return 0;
+    if(n > TIMER_MAX_CHANNELS)
+        n = TIMER_MAX_CHANNELS;
+
+    dev->channels = kcalloc(n, sizeof(*dev->channels), GFP_KERNEL);
+    dev->heap = kcalloc(n, sizeof(*dev->heap), GFP_KERNEL);
+    if(dev->channels == NULL || dev->heap == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    for(i = 0; i < n; i ++) {
+        gpio = of_get_named_gpio(dev->nd, "channel-gpios", i);
+        if(gpio < 0 || gpio_cansleep(gpio) || gpio_request(gpio, "timerchan")) {
+            printk("can't use channel %d!\r\n", i);
+            ret = -EINVAL;
+            goto fail;
+        }
+        gpio_direction_output(gpio, 1);
+        dev->channels[i].gpio = gpio;
+        dev->channels[i].sta = 1;
+        dev->channels[i].idx = -1;
+        dev->nchannels ++;
+    }
+    dev->chan_stats.channels = dev->nchannels;
+    return 0;
+
+fail:
+    for(i = 0; i < dev->nchannels; i ++)
+        gpio_free(dev->channels[i].gpio);
+    dev->nchannels = 0;
+    kfree(dev->channels);
+    kfree(dev->heap);
+    return ret;
+}
+
+static void chan_exit(struct timer_dev *dev)
+{
+    int i;
+
+    hrtimer_cancel(&dev->chan_timer);
+    for(i = 0; i < dev->nchannels; i ++) {
+        gpio_set_value(dev->channels[i].gpio, 1);
+        gpio_free(dev->channels[i].gpio);
     }
+    kfree(dev->channels);
+    kfree(dev->heap);
+}
+
+/* 复制一份修改后的配置并发布，调用者持有cfg_lock */
+static int timer_cfg_publish(struct timer_ctx *ctx, const struct timer_cfg *val)
+{
+    struct timer_cfg *new, *old;
 
+    new = kmalloc(sizeof(*new), GFP_KERNEL);
+    if(new == NULL)
+        return -ENOMEM;
+    *new = *val;
+
+    old = rcu_dereference_protected(ctx->cfg, lockdep_is_held(&ctx->cfg_lock));
+    rcu_assign_pointer(ctx->cfg, new);
+    if(old)
+        kfree_rcu(old, rcu);
     return 0;
 }
 
-/* open函数用来设置初始化，设置private_data为&timerdev */
+/* 当前配置的副本，调用者持有cfg_lock */
+static struct timer_cfg timer_cfg_get(struct timer_ctx *ctx)
+{
+    return *rcu_dereference_protected(ctx->cfg, lockdep_is_held(&ctx->cfg_lock));
+}
+
+/* 停止所有定时器并等待排队的翻转完成，之后没有回调在运行，调用者持有cfg_lock */
+static void timer_stop(struct timer_ctx *ctx)
+{
+    del_timer_sync(&ctx->timer);    /* 此函数内部需要传递地址型数据 */
+    del_timer_sync(&ctx->dtimer);
+    hrtimer_cancel(&ctx->hrtimer);
+    flush_kthread_work(&ctx->work);
+}
+
+/* 按配置启动对应的定时器，调用者持有cfg_lock */
+static void timer_start(struct timer_ctx *ctx, const struct timer_cfg *cfg)
+{
+    if(cfg->hr) {
+        /* 到期时间为一个范围，内核可以在范围内和其他定时器一起处理 */
+        hrtimer_start_range_ns(&ctx->hrtimer, ns_to_ktime((u64)cfg->period_us * NSEC_PER_USEC),
+                               (u64)cfg->slack_us * NSEC_PER_USEC, HRTIMER_MODE_REL);
+        return;
+    }
+    /*
+    * mod_timer:用于修改定时值，如果定时器还没有激活的话， mod_timer 函数会激活定时器
+    * msecs_to_jiffies:将给定的毫秒数（msecs）转换为对应的时钟节拍数(jiffies)
+    */
+    ctx->jnext = jiffies + msecs_to_jiffies(cfg->timeperiod);
+    mod_timer(ctx->jtimer, ctx->jnext);
+}
+
+/*
+* 按slack选择jiffies定时器，调用者持有cfg_lock并且定时器已经停止
+* 普通定时器的slack让mod_timer把到期时间向后取整，和其他定时器落在同一个tick
+* slack很大时用deferrable定时器，CPU空闲时等到下一次别的唤醒再处理
+*/
+static void timer_slack_apply(struct timer_ctx *ctx, unsigned int slack_us)
+{
+    if(slack_us >= TIMER_DEFER_SLACK_US) {
+        ctx->jtimer = &ctx->dtimer;
+        return;
+    }
+    ctx->jtimer = &ctx->timer;
+    set_timer_slack(&ctx->timer, usecs_to_jiffies(slack_us));
+}
+
+/*
+* 占用第out个输出，out为-1时只交还当前的输出
+* 调用者持有cfg_lock并且定时器已经停止，回调里不会看到gpio变化
+*/
+static int timer_output_set(struct timer_ctx *ctx, int out)
+{
+    struct timer_dev *dev = ctx->dev;
+    int ret = 0;
+
+    if(out < -1 || out >= dev->noutputs)
+        return -EINVAL;
+    if(out == ctx->out)
+        return 0;
+
+    mutex_lock(&dev->lock);
+    if(out >= 0 && dev->outputs[out].owner) {
+        ret = -EBUSY;
+        goto unlock;
+    }
+    if(ctx->out >= 0) {
+        gpio_set_value_cansleep(ctx->gpio, 1);  /* 交还时熄灭 */
+        dev->outputs[ctx->out].owner = NULL;
+    }
+    ctx->out = out;
+    ctx->gpio = -1;
+    if(out >= 0) {
+        dev->outputs[out].owner = ctx;
+        ctx->gpio = dev->outputs[out].gpio;
+    }
+    /* I2C/SPI扩展出来的GPIO会睡眠，不能在定时器回调中写 */
+    ctx->offload = ctx->want_worker || (ctx->gpio >= 0 && gpio_cansleep(ctx->gpio));
+unlock:
+    mutex_unlock(&dev->lock);
+    return ret;
+}
+
+void timer_function(unsigned long arg);
+static enum hrtimer_restart timer_hrtimer_function(struct hrtimer *timer);
+static void timer_work_function(struct kthread_work *work);
+
+/* open函数为每个文件分配自己的定时器，设置private_data为它 */
 static int timer_open(struct inode *inode, struct file *filp)
 {
+    struct timer_dev *dev = container_of(inode->i_cdev, struct timer_dev, cdev);
+    struct timer_ctx *ctx;
+    struct timer_cfg cfg = {
+        .timeperiod = 1000,
+    };
     int ret;
-    filp->private_data = &timerdev;
 
-    timerdev.timeperiod = 1000;
-    /* 调用一次初始化 */
-    ret = led_init();
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if(ctx == NULL)
+        return -ENOMEM;
+    ctx->dev = dev;
+    ctx->gpio = -1;
+    ctx->out = -1;
+    ctx->sta = 1;
+    mutex_init(&ctx->cfg_lock);
+    seqcount_init(&ctx->stats_seq);
+    seqcount_init(&ctx->work_seq);
+    atomic64_set(&ctx->ticks.count, 0);
+    init_waitqueue_head(&ctx->ticks.wait);
+    atomic64_set(&ctx->cursor, 0);
+    ctx->watch = &ctx->ticks;
+    ctx->pid = task_tgid_nr(current);
+    get_task_comm(ctx->comm, current);
+    init_kthread_work(&ctx->work, timer_work_function);
+
+    init_timer(&ctx->timer);
+    /* 设置定时器回调函数 */
+    ctx->timer.function = timer_function;
+    /* 设置要传递给 timer_function 函数的参数为本文件的ctx */
+    ctx->timer.data = (unsigned long)ctx;
+    init_timer_deferrable(&ctx->dtimer);
+    ctx->dtimer.function = timer_function;
+    ctx->dtimer.data = (unsigned long)ctx;
+    timer_slack_apply(ctx, 0);
+    ctx->start_ns = ktime_get_ns();
+    hrtimer_init(&ctx->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ctx->hrtimer.function = timer_hrtimer_function;
+
+    mutex_lock(&ctx->cfg_lock);
+    ret = timer_cfg_publish(ctx, &cfg);
+    /* 和以前的用法兼容:第0个输出空闲时默认占用，否则不驱动输出，之后可以用SETOUTPUT_CMD选择 */
+    if(ret == 0)
+        timer_output_set(ctx, 0);
+    mutex_unlock(&ctx->cfg_lock);
     if(ret < 0) {
+        kfree(ctx);
         return ret;
     }
 
+    mutex_lock(&dev->lock);
+    list_add_tail(&ctx->node, &dev->ctxs);
+    mutex_unlock(&dev->lock);
+
+    filp->private_data = ctx;
     return 0;
 }
 
-static long timer_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/* 关闭文件时停止定时器，交还输出 */
+static int timer_release(struct inode *inode, struct file *filp)
 {
-    /* 强转数据 */
-    struct timer_dev *dev = (struct timer_dev *)filp->private_data;
-    int timerperiod;
-    unsigned long flags;        /* 中断状态 */
+    struct timer_ctx *ctx = filp->private_data;
+
+    mutex_lock(&ctx->cfg_lock);
+    timer_stop(ctx);
+    timer_output_set(ctx, -1);
+    mutex_unlock(&ctx->cfg_lock);
+
+    mutex_lock(&ctx->dev->lock);
+    list_del(&ctx->node);
+    mutex_unlock(&ctx->dev->lock);
+
+    /* 定时器已经停止，debugfs也看不到了，没有读者了 */
+    kfree(rcu_dereference_protected(ctx->cfg, 1));
+    kfree(ctx->lat);
+    kfree(ctx);
+    return 0;
+}
+
+/* 选择read/poll跟随的到期来源，游标从当前值开始，调用者持有cfg_lock */
+static int timer_watch_set(struct timer_ctx *ctx, int out)
+{
+    struct timer_ticks *watch, *old = ctx->watch;
+
+    if(out < -1 || out >= ctx->dev->noutputs)
+        return -EINVAL;
+    watch = out < 0 ? &ctx->ticks : &ctx->dev->outputs[out].ticks;
+    ACCESS_ONCE(ctx->watch) = watch;
+    atomic64_set(&ctx->cursor, atomic64_read(&watch->count));
+    /* 在原来的队列上等待的读者重新检查，改到新的队列上等待 */
+    if(old != watch)
+        wake_up_interruptible(&old->wait);
+    return 0;
+}
+
+/*
+* 取走上次之后的到期次数并前移游标，没有新的到期时返回0
+* 同一个文件的多个读者用cmpxchg分配，每次到期只会被读到一次
+*/
+static u64 timer_ticks_take(struct timer_ctx *ctx)
+{
+    struct timer_ticks *watch = ACCESS_ONCE(ctx->watch);
+    long long old, cur;
+
+    do {
+        old = atomic64_read(&ctx->cursor);
+        cur = atomic64_read(&watch->count);
+        if(cur == old)
+            return 0;
+    } while(atomic64_cmpxchg(&ctx->cursor, old, cur) != old);
+    return cur - old;
+}
+
+static bool timer_ticks_ready(struct timer_ctx *ctx)
+{
+    return atomic64_read(&ACCESS_ONCE(ctx->watch)->count) != atomic64_read(&ctx->cursor);
+}
+
+/*
+* 返回一个u64，为上次read之后的到期次数(错过的周期也计入)
+* 没有到期时阻塞，O_NONBLOCK时返回-EAGAIN
+*/
+static ssize_t timer_read(struct file *filp, char __user *buf, size_t cnt, loff_t *offt)
+{
+    struct timer_ctx *ctx = filp->private_data;
+    struct timer_ticks *watch;
+    u64 ticks;
+    int ret;
+
+    if(cnt < sizeof(ticks))
+        return -EINVAL;
+
+    while(1) {
+        ticks = timer_ticks_take(ctx);
+        if(ticks)
+            break;
+        if(filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        /* WATCH_CMD换了跟随的计数时也返回，到新的队列上等待 */
+        watch = ACCESS_ONCE(ctx->watch);
+        ret = wait_event_interruptible(watch->wait,
+                                       timer_ticks_ready(ctx) || ACCESS_ONCE(ctx->watch) != watch);
+        if(ret)
+            return ret;
+    }
+
+    if(copy_to_user(buf, &ticks, sizeof(ticks)))
+        return -EFAULT;
+    return sizeof(ticks);
+}
+
+static unsigned int timer_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct timer_ctx *ctx = filp->private_data;
+
+    poll_wait(filp, &ACCESS_ONCE(ctx->watch)->wait, wait);
+    if(timer_ticks_ready(ctx))
+        return POLLIN | POLLRDNORM;
+    return 0;
+}
+
+/* 清零延迟统计，调用者在stats_seq的写区间内 */
+static void timer_lat_reset(struct timer_lat *lat)
+{
+    memset(lat, 0, sizeof(*lat));
+    lat->min_ns = U64_MAX;
+}
+
+/* 记录一次到期的延迟，只在定时器回调中调用 */
+static void timer_lat_add(struct timer_lat *lat, u64 late_ns)
+{
+    u64 us = div_u64(late_ns, NSEC_PER_USEC);
+
+    lat->samples ++;
+    lat->sum_ns += late_ns;
+    if(late_ns < lat->min_ns)
+        lat->min_ns = late_ns;
+    if(late_ns > lat->max_ns)
+        lat->max_ns = late_ns;
+    if(us < TIMER_HIST_BUCKETS)
+        lat->buckets[us] ++;
+    else
+        lat->overflow ++;
+}
+
+/*
+* 打开或停止测试模式，调用者持有cfg_lock
+* lat分配后一直保留到release，停止后仍然可以用GETHIST_CMD读取
+*/
+static int timer_testmode_set(struct timer_ctx *ctx, bool on, const struct timer_cfg *cfg)
+{
+    struct timer_lat *lat;
+
+    if(!on) {
+        ACCESS_ONCE(ctx->testing) = false;
+        return 0;
+    }
+    if(ctx->lat == NULL) {
+        lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+        if(lat == NULL)
+            return -ENOMEM;
+        timer_lat_reset(lat);
+        mutex_lock(&ctx->dev->lock);
+        ctx->lat = lat;
+        mutex_unlock(&ctx->dev->lock);
+    }
+
+    /* 停下定时器再清零，重新开始的测量不混入之前的到期 */
+    timer_stop(ctx);
+    write_seqcount_begin(&ctx->stats_seq);
+    timer_lat_reset(ctx->lat);
+    write_seqcount_end(&ctx->stats_seq);
+    ctx->testing = true;
+    if(ctx->running)
+        timer_start(ctx, cfg);
+    return 0;
+}
+
+/* 在stats_seq下拷贝一份延迟统计，返回重试后的副本 */
+static void timer_lat_read(struct timer_ctx *ctx, struct timer_lat *lat)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&ctx->stats_seq);
+        memcpy(lat, ctx->lat, sizeof(*lat));
+    } while(read_seqcount_retry(&ctx->stats_seq, seq));
+}
+
+static int timer_gethist(struct timer_ctx *ctx, unsigned long arg)
+{
+    struct timer_hist *hist;
+    struct timer_lat *lat;
+    int ret = 0;
+
+    if(ctx->lat == NULL)
+        return -ENODATA;
+
+    /* 两个都有4KB，不放在内核栈上 */
+    lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+    hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+    if(lat == NULL || hist == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    timer_lat_read(ctx, lat);
+    hist->samples = lat->samples;
+    hist->min_ns = lat->samples ? lat->min_ns : 0;
+    hist->avg_ns = lat->samples ? div64_u64(lat->sum_ns, lat->samples) : 0;
+    hist->max_ns = lat->max_ns;
+    hist->overflow = lat->overflow;
+    memcpy(hist->buckets, lat->buckets, sizeof(hist->buckets));
+    if(copy_to_user((void __user *)arg, hist, sizeof(*hist)))
+        ret = -EFAULT;
+out:
+    kfree(lat);
+    kfree(hist);
+    return ret;
+}
+
+/* 统计只读，不需要cfg_lock */
+static void timer_stats_read(struct timer_ctx *ctx, struct timer_stats *stats)
+{
+    unsigned int seq;
+    u64 sum, start_ns, elapsed_us;
+
+    do {
+        seq = read_seqcount_begin(&ctx->stats_seq);
+        *stats = ctx->stats;
+        start_ns = ctx->start_ns;
+    } while(read_seqcount_retry(&ctx->stats_seq, seq));
+    stats->elapsed_ns = ktime_get_ns() - start_ns;
+    elapsed_us = div_u64(stats->elapsed_ns, NSEC_PER_USEC);
+    stats->wakeups_mps = elapsed_us ? div64_u64(stats->wakeups * 1000000000ULL, elapsed_us) : 0;
+    do {
+        seq = read_seqcount_begin(&ctx->work_seq);
+        stats->work_toggles = ctx->stats.work_toggles;
+        stats->last_toggle_ns = ctx->stats.last_toggle_ns;
+        stats->max_toggle_ns = ctx->stats.max_toggle_ns;
+        sum = ctx->toggle_sum_ns;
+    } while(read_seqcount_retry(&ctx->work_seq, seq));
+    stats->avg_toggle_ns = stats->work_toggles ? div64_u64(sum, stats->work_toggles) : 0;
+}
+
+/* 执行一条修改本文件定时器的命令，单个ioctl和批量提交共用，调用者持有cfg_lock */
+static int timer_ctx_cmd(struct timer_ctx *ctx, unsigned int cmd, unsigned long arg)
+{
+    struct timer_cfg cfg = timer_cfg_get(ctx);
+    int ret = 0;
 
     switch (cmd)
     {
     case CLOSE_CMD:
-        del_timer_sync(&dev->timer);    /* 此函数内部需要传递地址型数据 */
+        timer_stop(ctx);
+        ctx->running = false;
         break;
     case OPEN_CMD:
-        /* dev->timerperiod的值可能会被其他程序引用或修改，设置自旋锁 */
-        spin_lock_irqsave(&dev->lock, flags);
-        timerperiod = dev->timeperiod;
-        spin_unlock_irqrestore(&dev->lock, flags);
-        /*
-        * mod_timer:用于修改定时值，如果定时器还没有激活的话， mod_timer 函数会激活定时器
-        * msecs_to_jiffies:将给定的毫秒数（msecs）转换为对应的时钟节拍数(jiffies)
-        */
-        mod_timer(&dev->timer, jiffies + msecs_to_jiffies(timerperiod));
+        /* 先停下定时器，清零统计时没有回调在写 */
+        timer_stop(ctx);
+        write_seqcount_begin(&ctx->stats_seq);
+        write_seqcount_begin(&ctx->work_seq);
+        memset(&ctx->stats, 0, sizeof(ctx->stats));
+        ctx->toggle_sum_ns = 0;
+        ctx->start_ns = ktime_get_ns();
+        if(ctx->lat)
+            timer_lat_reset(ctx->lat);
+        write_seqcount_end(&ctx->work_seq);
+        write_seqcount_end(&ctx->stats_seq);
+        timer_start(ctx, &cfg);
+        ctx->running = true;
         break;
     case SETPERIOD_CMD:
-        spin_lock_irqsave(&dev->lock, flags);
-        dev->timeperiod = arg;
-        spin_unlock_irqrestore(&dev->lock, flags);
-        mod_timer(&dev->timer, jiffies + msecs_to_jiffies(arg));
+        /* 切换回jiffies定时器 */
+        cfg.timeperiod = arg;
+        cfg.hr = false;
+        ret = timer_cfg_publish(ctx, &cfg);
+        if(ret < 0)
+            break;
+        timer_stop(ctx);
+        timer_start(ctx, &cfg);
+        ctx->running = true;
+        break;
+    case SETPERIOD_US_CMD:
+        /* jiffies定时器的精度受HZ限制，亚毫秒周期使用高精度定时器 */
+        if(arg < TIMER_MIN_US) {
+            ret = -EINVAL;
+            break;
+        }
+        cfg.period_us = arg;
+        cfg.hr = true;
+        ret = timer_cfg_publish(ctx, &cfg);
+        if(ret < 0)
+            break;
+        timer_stop(ctx);
+        timer_start(ctx, &cfg);
+        ctx->running = true;
+        break;
+    case SETSLACK_CMD:
+        /* 高精度定时器在回调中按新的slack设置范围，jiffies定时器要停下来换 */
+        if(arg > TIMER_SLACK_MAX_US) {
+            ret = -EINVAL;
+            break;
+        }
+        cfg.slack_us = arg;
+        ret = timer_cfg_publish(ctx, &cfg);
+        if(ret < 0)
+            break;
+        timer_stop(ctx);
+        timer_slack_apply(ctx, cfg.slack_us);
+        if(ctx->running)
+            timer_start(ctx, &cfg);
+        break;
+    case SETOUTPUT_CMD:
+        /* 停下定时器再换输出，已经在运行的话换好后按原配置继续 */
+        timer_stop(ctx);
+        ret = timer_output_set(ctx, (int)arg);
+        if(ctx->running)
+            timer_start(ctx, &cfg);
+        break;
+    case WATCH_CMD:
+        ret = timer_watch_set(ctx, (int)arg);
+        break;
+    case TESTMODE_CMD:
+        ret = timer_testmode_set(ctx, arg != 0, &cfg);
+        break;
+    case SETWORKER_CMD:
+        timer_stop(ctx);
+        ctx->want_worker = arg != 0;
+        ctx->offload = ctx->want_worker || (ctx->gpio >= 0 && gpio_cansleep(ctx->gpio));
+        if(ctx->running)
+            timer_start(ctx, &cfg);
         break;
     default:
         break;
     }
-    return 0;
+    return ret;
+}
+
+/*
+* 批量提交前的检查，能提前发现的错误都在这里返回，避免只执行了一半
+* 输出是否被其他文件占用只是检查时的状态，执行前仍可能被抢走
+*/
+static int timer_cmd_check(struct timer_ctx *ctx, const struct timer_cmd *c)
+{
+    struct timer_dev *dev = ctx->dev;
+    int out = (int)c->arg;
+    int ret = 0;
+
+    switch (c->op)
+    {
+    case CLOSE_CMD:
+    case OPEN_CMD:
+    case SETPERIOD_CMD:
+    case SETWORKER_CMD:
+    case TESTMODE_CMD:
+    case GETSTATS_CMD:
+        return 0;
+    case SETSLACK_CMD:
+        return c->arg > TIMER_SLACK_MAX_US ? -EINVAL : 0;
+    case SETPERIOD_US_CMD:
+        return c->arg < TIMER_MIN_US ? -EINVAL : 0;
+    case SETOUTPUT_CMD:
+        if(out < -1 || out >= dev->noutputs)
+            return -EINVAL;
+        if(out < 0)
+            return 0;
+        mutex_lock(&dev->lock);
+        if(dev->outputs[out].owner && dev->outputs[out].owner != ctx)
+            ret = -EBUSY;
+        mutex_unlock(&dev->lock);
+        return ret;
+    case WATCH_CMD:
+        return out < -1 || out >= dev->noutputs ? -EINVAL : 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+/*
+* 一次系统调用执行一组命令:先全部检查，检查出错误时一条都不执行
+* 然后在cfg_lock下依次执行，同一文件的其他ioctl看不到执行到一半的状态
+* 执行时才出现的错误(输出刚被其他文件占用、内存不足)不能回滚:
+* 停在这一条，之前的命令保持已执行的效果，之后的命令返回-ECANCELED
+* 每条命令的返回值写回用户的数组，ioctl本身返回第一个失败的返回值
+*/
+static int timer_batch(struct timer_ctx *ctx, unsigned long arg)
+{
+    struct timer_batch batch;
+    struct timer_cmd *cmds;
+    struct timer_stats stats;
+    void __user *ucmds;
+    size_t size;
+    int i, ret = 0;
+
+    if(copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+        return -EFAULT;
+    if(batch.count == 0 || batch.count > TIMER_BATCH_MAX)
+        return -EINVAL;
+
+    ucmds = (void __user *)(unsigned long)batch.cmds;
+    size = batch.count * sizeof(*cmds);
+    cmds = kmalloc(size, GFP_KERNEL);
+    if(cmds == NULL)
+        return -ENOMEM;
+    if(copy_from_user(cmds, ucmds, size)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    for(i = 0; i < batch.count; i ++) {
+        cmds[i].result = timer_cmd_check(ctx, &cmds[i]);
+        cmds[i].value = 0;
+        if(cmds[i].result < 0 && ret == 0)
+            ret = cmds[i].result;
+    }
+    if(ret < 0)
+        goto copy;
+
+    mutex_lock(&ctx->cfg_lock);
+    for(i = 0; i < batch.count; i ++) {
+        if(ret < 0) {
+            cmds[i].result = -ECANCELED;
+            continue;
+        }
+        if(cmds[i].op == GETSTATS_CMD) {
+            timer_stats_read(ctx, &stats);
+            cmds[i].value = stats.ticks;
+            continue;
+        }
+        cmds[i].result = timer_ctx_cmd(ctx, cmds[i].op, cmds[i].arg);
+        if(cmds[i].result < 0)
+            ret = cmds[i].result;
+    }
+    mutex_unlock(&ctx->cfg_lock);
+
+copy:
+    if(copy_to_user(ucmds, cmds, size))
+        ret = -EFAULT;
+out:
+    kfree(cmds);
+    return ret;
+}
+
+static long timer_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    /* 强转数据 */
+    struct timer_ctx *ctx = (struct timer_ctx *)filp->private_data;
+    struct timer_dev *dev = ctx->dev;
+    struct timer_stats stats;
+    struct timer_chan_stats chan_stats;
+    struct timer_chan chan;
+    struct sched_param param;
+    unsigned int seq;
+    int ret;
+
+    if(cmd == GETSTATS_CMD) {
+        timer_stats_read(ctx, &stats);
+        if(copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+    }
+    if(cmd == GETCHANSTATS_CMD) {
+        do {
+            seq = read_seqcount_begin(&dev->chan_seq);
+            chan_stats = dev->chan_stats;
+        } while(read_seqcount_retry(&dev->chan_seq, seq));
+        chan_stats.active = ACCESS_ONCE(dev->heap_n);
+        if(copy_to_user((void __user *)arg, &chan_stats, sizeof(chan_stats)))
+            return -EFAULT;
+        return 0;
+    }
+
+    /* 多通道属于实例，由dev->lock保护 */
+    if(cmd == SETCHAN_CMD) {
+        if(copy_from_user(&chan, (void __user *)arg, sizeof(chan)))
+            return -EFAULT;
+        mutex_lock(&dev->lock);
+        ret = timer_chan_set(dev, &chan);
+        mutex_unlock(&dev->lock);
+        return ret;
+    }
+    /* worker线程属于实例，修改优先级需要CAP_SYS_NICE，由sched_setscheduler检查 */
+    if(cmd == SETPRIO_CMD) {
+        if(arg < 1 || arg >= MAX_RT_PRIO)
+            return -EINVAL;
+        param.sched_priority = arg;
+        return sched_setscheduler(dev->worker_task, SCHED_FIFO, &param);
+    }
+    if(cmd == BATCH_CMD)
+        return timer_batch(ctx, arg);
+    if(cmd == GETHIST_CMD)
+        return timer_gethist(ctx, arg);
+
+    /* 同一个文件修改配置的人之间用mutex互斥，定时器回调不受影响 */
+    mutex_lock(&ctx->cfg_lock);
+    ret = timer_ctx_cmd(ctx, cmd, arg);
+    mutex_unlock(&ctx->cfg_lock);
+    return ret;
 }
 
 /* .unlocked_ioctl:被解锁的输入输出控制 */
 static struct file_operations timer_fops = {
     .owner = THIS_MODULE,
     .open = timer_open,
+    .release = timer_release,
+    .read = timer_read,
+    .poll = timer_poll,
     .unlocked_ioctl = timer_unlocked_ioctl,
 };
 
+/* debugfs: cat列出实例中所有打开的文件，以及测试模式的延迟直方图 */
+static int timer_ctxs_show(struct seq_file *m, void *v)
+{
+    struct timer_dev *dev = m->private;
+    struct timer_ctx *ctx;
+    struct timer_stats stats;
+    struct timer_lat *lat;
+    struct timer_cfg cfg;
+    unsigned int n;
+    u32 rem;
+
+    lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+    if(lat == NULL)
+        return -ENOMEM;
+
+    /* dev->lock下ctx不会被释放，lat也不会变化 */
+    mutex_lock(&dev->lock);
+    list_for_each_entry(ctx, &dev->ctxs, node) {
+        rcu_read_lock();
+        cfg = *rcu_dereference(ctx->cfg);
+        rcu_read_unlock();
+        timer_stats_read(ctx, &stats);
+
+        seq_printf(m, "%s[%d]: output=%d %s", ctx->comm, ctx->pid, ctx->out,
+                   ctx->running ? "running" : "stopped");
+        if(cfg.hr)
+            seq_printf(m, " period=%uus", cfg.period_us);
+        else
+            seq_printf(m, " period=%dms", cfg.timeperiod);
+        seq_printf(m, " slack=%uus%s", cfg.slack_us, ctx->jtimer == &ctx->dtimer ? "(deferrable)" : "");
+        seq_printf(m, "%s%s\n", ctx->offload ? " worker" : "", ctx->testing ? " testing" : "");
+        seq_printf(m, "  ticks=%llu overruns=%llu max_late=%lluns coalesced=%llu wakeups=%llu wakeups/s=%llu.%03u\n",
+                   stats.ticks, stats.overruns, stats.max_late_ns, stats.coalesced, stats.wakeups,
+                   div_u64_rem(stats.wakeups_mps, 1000, &rem), rem);
+
+        if(ctx->lat == NULL)
+            continue;
+        timer_lat_read(ctx, lat);
+        seq_printf(m, "  latency: samples=%llu min=%lluns avg=%lluns max=%lluns overflow=%llu\n",
+                   lat->samples, lat->samples ? lat->min_ns : 0,
+                   lat->samples ? div64_u64(lat->sum_ns, lat->samples) : 0,
+                   lat->max_ns, lat->overflow);
+        for(n = 0; n < TIMER_HIST_BUCKETS; n ++) {
+            if(lat->buckets[n])
+                seq_printf(m, "  %6u us : %u\n", n, lat->buckets[n]);
+        }
+    }
+    mutex_unlock(&dev->lock);
+
+    kfree(lat);
+    return 0;
+}
+
+static int timer_ctxs_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, timer_ctxs_show, inode->i_private);
+}
+
+static const struct file_operations timer_ctxs_fops = {
+    .owner = THIS_MODULE,
+    .open = timer_ctxs_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* 计数前进并唤醒只在这个计数上等待的读者 */
+static void timer_ticks_add(struct timer_ticks *ticks, unsigned long n)
+{
+    atomic64_add(n, &ticks->count);
+    smp_mb();   /* 计数的更新要在检查等待队列之前可见，和wait_event中的检查配对 */
+    if(waitqueue_active(&ticks->wait))
+        wake_up_interruptible(&ticks->wait);
+}
+
+/*
+* 记录一次到期，只在定时器回调中调用
+* 两个定时器不会同时运行(切换时先停掉另一个)，所以seqcount只有一个写者
+* coalesced表示这次回调是其他唤醒顺带处理的
+*/
+static void timer_account(struct timer_ctx *ctx, u64 late_ns, unsigned long overruns, bool coalesced)
+{
+    struct timer_dev *dev = ctx->dev;
+
+    write_seqcount_begin(&ctx->stats_seq);
+    ctx->stats.ticks ++;
+    if(coalesced)
+        ctx->stats.coalesced ++;
+    else
+        ctx->stats.wakeups ++;
+    ctx->stats.overruns += overruns;
+    ctx->stats.last_late_ns = late_ns;
+    if(late_ns > ctx->stats.max_late_ns)
+        ctx->stats.max_late_ns = late_ns;
+    if(ctx->testing)
+        timer_lat_add(ctx->lat, late_ns);
+    write_seqcount_end(&ctx->stats_seq);
+
+    /* 通知read/poll，和timerfd一样错过的周期也算到期 */
+    timer_ticks_add(&ctx->ticks, 1 + overruns);
+    if(ctx->out >= 0)
+        timer_ticks_add(&dev->outputs[ctx->out].ticks, 1 + overruns);
+}
+
+/*
+* worker线程中翻转，可以睡眠
+* 统计从定时器回调排队到GPIO写完的时间，慢速总线上主要是传输的时间
+*/
+static void timer_work_function(struct kthread_work *work)
+{
+    struct timer_ctx *ctx = container_of(work, struct timer_ctx, work);
+    u64 queued_ns = ACCESS_ONCE(ctx->queued_ns);
+    u64 lat;
+
+    ctx->sta = !ctx->sta;
+    if(ctx->gpio >= 0)
+        gpio_set_value_cansleep(ctx->gpio, ctx->sta);
+    lat = ktime_to_ns(ktime_get()) - queued_ns;
+
+    write_seqcount_begin(&ctx->work_seq);
+    ctx->stats.work_toggles ++;
+    ctx->stats.last_toggle_ns = lat;
+    if(lat > ctx->stats.max_toggle_ns)
+        ctx->stats.max_toggle_ns = lat;
+    ctx->toggle_sum_ns += lat;
+    write_seqcount_end(&ctx->work_seq);
+}
+
+/*
+* 翻转本文件占用的输出，没有占用时只计数
+* worker模式下只排队，上一次还没处理完时这次合并掉
+*/
+static void timer_toggle(struct timer_ctx *ctx)
+{
+    if(ctx->offload) {
+        ACCESS_ONCE(ctx->queued_ns) = ktime_to_ns(ktime_get());
+        if(!queue_kthread_work(&ctx->dev->worker, &ctx->work)) {
+            write_seqcount_begin(&ctx->stats_seq);
+            ctx->stats.work_dropped ++;
+            write_seqcount_end(&ctx->stats_seq);
+        }
+        return;
+    }
+    ctx->sta = !ctx->sta;
+    if(ctx->gpio >= 0)
+        gpio_set_value(ctx->gpio, ctx->sta);
+}
+
 /* 定时器回调函数:用于实现led灯翻转 */
-/* arg参数为timerdev的地址 */
+/* arg参数为ctx的地址 */
 void timer_function(unsigned long arg)
 {
-    struct timer_dev *dev = (struct timer_dev *)arg;
-    static int sta = 1;
+    struct timer_ctx *ctx = (struct timer_ctx *)arg;
     int timerperiod;
-    unsigned long flags;
+    unsigned long now = jiffies;
+    unsigned long expires = ctx->jnext;     /* 理想到期时间，slack取整后的expires会更晚 */
+    unsigned long period, next, missed = 0;
+    /* deferrable定时器晚于expires运行，说明CPU空闲时没有为它唤醒，等到了别的唤醒 */
+    bool coalesced = ctx->jtimer == &ctx->dtimer && time_after(now, ctx->jtimer->expires);
 
-    sta = !sta;
-    gpio_set_value(dev->led_gpio, sta);
+    timer_toggle(ctx);
 
     /* 由于内核的定时器不是循环的定时器，所以需要重启定时器 */
     /* 重启定时器 */
-    spin_lock_irqsave(&dev->lock, flags);
-    timerperiod = dev->timeperiod;
-    spin_unlock_irqrestore(&dev->lock, flags);
-    mod_timer(&dev->timer, jiffies + msecs_to_jiffies(timerperiod));
+    rcu_read_lock();
+    timerperiod = rcu_dereference(ctx->cfg)->timeperiod;
+    rcu_read_unlock();
+    period = max(msecs_to_jiffies(timerperiod), 1UL);
+    /*
+    * 从理想到期时间而不是回调执行时间开始计算下一次，回调的延迟不会累积
+    * 已经错过的周期直接跳过并计入overruns
+    */
+    next = expires + period;
+    if(time_after_eq(now, next)) {
+        missed = (now - next) / period + 1;
+        next += missed * period;
+    }
+    timer_account(ctx, (u64)jiffies_to_usecs(now - expires) * NSEC_PER_USEC, missed, coalesced);
+    ctx->jnext = next;
+    mod_timer(ctx->jtimer, next);
 }
 
-static int __init timer_init(void)
+/* 高精度定时器回调函数，在硬中断中执行，同样翻转led */
+static enum hrtimer_restart timer_hrtimer_function(struct hrtimer *timer)
 {
+    struct timer_ctx *ctx = container_of(timer, struct timer_ctx, hrtimer);
+    struct timer_cfg *cfg;
+    unsigned int period_us, slack_us;
+    bool hr;
+    ktime_t now;
+    s64 late_ns;
+    u64 n;
+    bool coalesced;
+
+    rcu_read_lock();
+    cfg = rcu_dereference(ctx->cfg);
+    period_us = cfg->period_us;
+    slack_us = cfg->slack_us;
+    hr = cfg->hr;
+    rcu_read_unlock();
+    /* 已经切换回jiffies定时器 */
+    if(!hr)
+        return HRTIMER_NORESTART;
 
-    spin_lock_init(&timerdev.lock);
+    timer_toggle(ctx);
 
-    if(timerdev.major) {
-        timerdev.devid = MKDEV(timerdev.major, 0);
-        register_chrdev_region(timerdev.devid, TIMER_CNT, TIMER_NAME);
-    } else {
-        alloc_chrdev_region(&timerdev.devid, 0, TIMER_CNT, TIMER_NAME);
-        timerdev.major = MAJOR(timerdev.devid);
-        timerdev.minor = MINOR(timerdev.devid);
+    /*
+    * hrtimer_forward从上一次的到期时间向后推，返回推进的周期数，大于1说明有周期被错过
+    * 有slack时回调可能在范围的开头运行，早于范围的末尾，先把到期时间收回到开头再推进
+    * 否则hrtimer_forward认为还没到期，不会推进
+    */
+    now = ktime_get();
+    late_ns = ktime_to_ns(ktime_sub(now, hrtimer_get_softexpires(timer)));
+    /*
+    * 时钟事件按最早的范围末尾编程，在末尾之前运行说明中断是为别的定时器产生的
+    * 严格模式下范围的开头和末尾相同，每次回调都是自己的唤醒
+    */
+    coalesced = ktime_before(now, hrtimer_get_expires(timer));
+    hrtimer_set_expires(timer, hrtimer_get_softexpires(timer));
+    n = hrtimer_forward(timer, now, ns_to_ktime((u64)period_us * NSEC_PER_USEC));
+    hrtimer_set_expires_range_ns(timer, hrtimer_get_softexpires(timer), (u64)slack_us * NSEC_PER_USEC);
+
+    timer_account(ctx, late_ns > 0 ? late_ns : 0, n > 1 ? n - 1 : 0, coalesced);
+    return HRTIMER_RESTART;
+}
+
+/* 创建一个实例:初始化led、多通道，注册cdev和设备节点，定时器在open时创建 */
+static struct timer_dev *timer_create_one(int index, const char *path)
+{
+    struct timer_dev *dev;
+    struct sched_param param = {
+        .sched_priority = clamp(worker_prio, 1, MAX_RT_PRIO - 1),
+    };
+    int ret;
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if(dev == NULL)
+        return ERR_PTR(-ENOMEM);
+
+    mutex_init(&dev->lock);
+    INIT_LIST_HEAD(&dev->ctxs);
+    ret = led_init(dev, path);
+    if(ret < 0)
+        goto fail_led;
+    hrtimer_init(&dev->chan_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    dev->chan_timer.function = timer_chan_function;
+    seqcount_init(&dev->chan_seq);
+    ret = chan_init(dev);
+    if(ret < 0)
+        goto fail_chan;
+
+    init_kthread_worker(&dev->worker);
+    dev->worker_task = kthread_run(kthread_worker_fn, &dev->worker, TIMER_NAME "%d", index);
+    if(IS_ERR(dev->worker_task)) {
+        ret = PTR_ERR(dev->worker_task);
+        goto fail_worker;
     }
-    printk("major=%d, minor=%d", timerdev.major, timerdev.minor);
+    sched_setscheduler_nocheck(dev->worker_task, SCHED_FIFO, &param);
 
+    dev->devid = MKDEV(timer_major, MINOR(timer_devid) + index);
     /* THIS_MODULE定义为(struct module *)0 */
-    timerdev.cdev.owner = THIS_MODULE;
-    cdev_init(&timerdev.cdev, &timer_fops);
+    dev->cdev.owner = THIS_MODULE;
+    cdev_init(&dev->cdev, &timer_fops);
+    ret = cdev_add(&dev->cdev, dev->devid, 1);
+    if(ret < 0)
+        goto fail_cdev;
+
+    if(index == 0)
+        dev->device = device_create(timer_class, NULL, dev->devid, NULL, TIMER_NAME);
+    else
+        dev->device = device_create(timer_class, NULL, dev->devid, NULL, TIMER_NAME "%d", index);
+    if(IS_ERR(dev->device)) {
+        ret = PTR_ERR(dev->device);
+        goto fail_device;
+    }
+    /* /sys/kernel/debug/timerdev/<设备名>，没有使能debugfs时忽略 */
+    if(!IS_ERR_OR_NULL(timer_debugfs))
+        debugfs_create_file(dev_name(dev->device), 0444, timer_debugfs, dev, &timer_ctxs_fops);
+    printk("%s: major=%d, minor=%d\r\n", path, MAJOR(dev->devid), MINOR(dev->devid));
+    return dev;
+
+fail_device:
+    cdev_del(&dev->cdev);
+fail_cdev:
+    kthread_stop(dev->worker_task);
+fail_worker:
+    chan_exit(dev);
+fail_chan:
+    led_exit(dev);
+fail_led:
+    kfree(dev);
+    return ERR_PTR(ret);
+}
+
+static void timer_destroy_one(struct timer_dev *dev)
+{
+    /* 模块被引用时不能卸载，到这里所有文件都已release，各自的定时器已经停止 */
+    kthread_stop(dev->worker_task);
+    chan_exit(dev);
+    led_exit(dev);
 
-    cdev_add(&timerdev.cdev, timerdev.devid, TIMER_CNT);
+    /* 设备为在class这个大类中的某个id:如gpio大类，device可能为1, 2, 3 ...所以删除时需要指明id号 */
+    device_destroy(timer_class, dev->devid);
+    cdev_del(&dev->cdev);
+    kfree(dev);
+}
+
+static int __init timer_init(void)
+{
+    struct timer_dev *dev;
+    int i, ret, created = 0;
+
+    if(nodes_num > TIMER_CNT)
+        nodes_num = TIMER_CNT;
+
+    ret = alloc_chrdev_region(&timer_devid, 0, TIMER_CNT, TIMER_NAME);
+    if(ret < 0)
+        return ret;
+    timer_major = MAJOR(timer_devid);
 
     /* class_create返回值为class类型 */
-    timerdev.class = class_create(THIS_MODULE, TIMER_NAME);
-    if(IS_ERR(timerdev.class)) {
-        return PTR_ERR(timerdev.class);
+    timer_class = class_create(THIS_MODULE, TIMER_NAME);
+    if(IS_ERR(timer_class)) {
+        unregister_chrdev_region(timer_devid, TIMER_CNT);
+        return PTR_ERR(timer_class);
     }
 
-    timerdev.device = device_create(timerdev.class, NULL, timerdev.devid, NULL, TIMER_NAME);
-    if(IS_ERR(timerdev.device)) {
-        return PTR_ERR(timerdev.class);
+    timer_debugfs = debugfs_create_dir(TIMER_NAME, NULL);
+
+    /* 找不到的节点跳过，至少要有一个实例 */
+    for(i = 0; i < nodes_num; i ++) {
+        dev = timer_create_one(i, nodes[i]);
+        if(IS_ERR(dev)) {
+            ret = PTR_ERR(dev);
+            continue;
+        }
+        timerdevs[i] = dev;
+        created ++;
+    }
+    if(created == 0) {
+        debugfs_remove_recursive(timer_debugfs);
+        class_destroy(timer_class);
+        unregister_chrdev_region(timer_devid, TIMER_CNT);
+        return ret < 0 ? ret : -EINVAL;
     }
 
-    init_timer(&timerdev.timer);
-    /* 设置定时器回调函数 */
-    timerdev.timer.function = timer_function;
-    /* 设置要传递给 timer_function 函数的参数为 timerdev 的地址 */
-    timerdev.timer.data = (unsigned long)&timerdev;
     return 0;
 }
 
 static void __exit timer_exit(void)
 {
-    gpio_set_value(timerdev.led_gpio, 1);
-    /* 同步删除:待其他处理器完成对定时器的操作后再进行删除 */
-    del_timer_sync(&timerdev.timer);
+    int i;
 
-    /* 删除一般从地址删除 */
-    /* 设备为在class这个大类中的某个id:如gpio大类，device可能为1, 2, 3 ...所以删除时需要指明id号 */
-    device_destroy(timerdev.class, timerdev.devid);
-    class_destroy(timerdev.class);
-    cdev_del(&timerdev.cdev);
-    unregister_chrdev_region(timerdev.devid, TIMER_CNT);
+    /* 先删除debugfs，之后不会再访问实例 */
+    debugfs_remove_recursive(timer_debugfs);
+    for(i = 0; i < TIMER_CNT; i ++) {
+        if(timerdevs[i])
+            timer_destroy_one(timerdevs[i]);
+    }
+
+    class_destroy(timer_class);
+    unregister_chrdev_region(timer_devid, TIMER_CNT);
 }
 
 module_init(timer_init);
@@ -3,27 +3,254 @@
 #include "sys/types.h"
 #include "sys/stat.h"
 #include "fcntl.h"
+#include "sys/ioctl.h"
 #include "stdlib.h"
 #include "string.h"
 #include "linux/ioctl.h"
+#include "linux/types.h"
+#include "time.h"
+
+struct timer_stats {
+    __u64 ticks;
+    __u64 overruns;
+    __u64 last_late_ns;
+    __u64 max_late_ns;
+    __u64 work_toggles;
+    __u64 work_dropped;
+    __u64 last_toggle_ns;
+    __u64 max_toggle_ns;
+    __u64 avg_toggle_ns;
+    __u64 coalesced;
+    __u64 wakeups;
+    __u64 elapsed_ns;
+    __u64 wakeups_mps;
+};
+
+#define TIMER_HIST_BUCKETS  1000
+
+struct timer_hist {
+    __u64 samples;
+    __u64 min_ns;
+    __u64 avg_ns;
+    __u64 max_ns;
+    __u64 overflow;
+    __u32 buckets[TIMER_HIST_BUCKETS];
+};
+
+struct timer_cmd {
+    __u32 op;
+    __u32 arg;
+    __s32 result;
+    __u32 pad;
+    __u64 value;
+};
+
+struct timer_batch {
+    __u64 cmds;
+    __u32 count;
+    __u32 pad;
+};
+
+struct timer_chan {
+    __u32 chan;
+    __u32 period_us;
+};
+
+struct timer_chan_stats {
+    __u32 channels;
+    __u32 active;
+    __u64 wakeups;
+    __u64 toggles;
+    __u64 overruns;
+};
 
 #define CLOSE_CMD   (_IO(0XEF, 0X1))
 #define OPEN_CMD    (_IO(0XEF, 0X2))
 #define SETPERIOD_CMD   (_IO(0XEF, 0X3))
+#define SETPERIOD_US_CMD    (_IO(0XEF, 0X4))
+#define GETSTATS_CMD    (_IOR(0XEF, 0X5, struct timer_stats))
+#define SETCHAN_CMD     (_IOW(0XEF, 0X6, struct timer_chan))
+#define GETCHANSTATS_CMD    (_IOR(0XEF, 0X7, struct timer_chan_stats))
+#define SETOUTPUT_CMD   (_IO(0XEF, 0X8))
+#define SETPRIO_CMD     (_IO(0XEF, 0X9))
+#define SETWORKER_CMD   (_IO(0XEF, 0XA))
+#define BATCH_CMD       (_IOW(0XEF, 0XB, struct timer_batch))
+#define TIMER_BATCH_MAX 64
+#define WATCH_CMD       (_IO(0XEF, 0XC))
+#define TESTMODE_CMD    (_IO(0XEF, 0XD))
+#define GETHIST_CMD     (_IOR(0XEF, 0XE, struct timer_hist))
+#define SETSLACK_CMD    (_IO(0XEF, 0XF))
+
+/* 脚本中的命令名和对应的ioctl命令码 */
+static const struct {
+    const char *name;
+    unsigned int op;
+} script_ops[] = {
+    { "close",     CLOSE_CMD },
+    { "open",      OPEN_CMD },
+    { "period",    SETPERIOD_CMD },
+    { "period_us", SETPERIOD_US_CMD },
+    { "output",    SETOUTPUT_CMD },
+    { "worker",    SETWORKER_CMD },
+    { "watch",     WATCH_CMD },
+    { "test",      TESTMODE_CMD },
+    { "slack",     SETSLACK_CMD },
+    { "query",     GETSTATS_CMD },
+};
+
+/*
+* @description:读取命令脚本，每行一条命令，格式为"命令名 [参数]"，#开头的行为注释
+* @return 命令条数，出错返回-1
+*/
+static int script_load(const char *path, struct timer_cmd *cmds)
+{
+    FILE *fp;
+    char line[128], name[32];
+    int arg, n = 0, lineno = 0, i;
+
+    fp = fopen(path, "r");
+    if(fp == NULL) {
+        printf("can't open %s file!\r\n", path);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        lineno ++;
+        arg = 0;
+        if(sscanf(line, "%31s %d", name, &arg) < 1 || name[0] == '#')
+            continue;
+        for(i = 0; i < sizeof(script_ops) / sizeof(script_ops[0]); i ++) {
+            if(strcmp(name, script_ops[i].name) == 0)
+                break;
+        }
+        if(i == sizeof(script_ops) / sizeof(script_ops[0]) || n == TIMER_BATCH_MAX) {
+            printf("%s:%d: bad command or too many commands\r\n", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+        memset(&cmds[n], 0, sizeof(cmds[n]));
+        cmds[n].op = script_ops[i].op;
+        cmds[n].arg = arg;
+        n ++;
+    }
+    fclose(fp);
+    return n;
+}
+
+/*
+* @description:把整个脚本作为一次BATCH_CMD提交repeat次，打印耗时和最后一次的结果
+*/
+static int script_run(int fd, const char *path, int repeat)
+{
+    struct timer_cmd cmds[TIMER_BATCH_MAX];
+    struct timer_batch batch;
+    struct timespec t0, t1;
+    double ns;
+    int n, i, ret = 0;
+
+    n = script_load(path, cmds);
+    if(n <= 0)
+        return -1;
+    batch.cmds = (unsigned long)cmds;
+    batch.count = n;
+    batch.pad = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < repeat; i ++) {
+        ret = ioctl(fd, BATCH_CMD, &batch);
+        if(ret < 0)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for(i = 0; i < n; i ++) {
+        printf("%2d: op=0x%08x arg=%u result=%d", i, cmds[i].op, cmds[i].arg, cmds[i].result);
+        if(cmds[i].op == GETSTATS_CMD)
+            printf(" ticks=%llu", cmds[i].value);
+        printf("\r\n");
+    }
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("%d batches of %d commands: %.0f ns/batch, %.0f ns/command\r\n",
+           repeat, n, ns / repeat, ns / repeat / n);
+    return ret;
+}
+
+/*
+* @description:类似cyclictest的延迟测试，按period_us周期运行到loops次到期
+* 延迟由驱动在每次到期时测量，这里只等待到期并打印结果
+*/
+static int bench_run(int fd, unsigned int period_us, unsigned long long loops)
+{
+    static struct timer_hist hist;
+    unsigned long long ticks, total = 0;
+    unsigned int i;
+
+    /* 测试不需要驱动led，不占用输出 */
+    ioctl(fd, SETOUTPUT_CMD, -1);
+    if(ioctl(fd, TESTMODE_CMD, 1) < 0 || ioctl(fd, SETPERIOD_US_CMD, period_us) < 0) {
+        printf("can't start test mode!\r\n");
+        return -1;
+    }
+    while(total < loops) {
+        if(read(fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+            break;
+        total += ticks;
+    }
+    ioctl(fd, CLOSE_CMD);
+    if(ioctl(fd, GETHIST_CMD, &hist) < 0) {
+        printf("can't get histogram!\r\n");
+        return -1;
+    }
+
+    printf("# period %uus, %llu samples\r\n", period_us, hist.samples);
+    printf("# min %lluns avg %lluns max %lluns overflow %llu\r\n",
+           hist.min_ns, hist.avg_ns, hist.max_ns, hist.overflow);
+    for(i = 0; i < TIMER_HIST_BUCKETS; i ++) {
+        if(hist.buckets[i])
+            printf("%06u %u\r\n", i, hist.buckets[i]);
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
-    int fd, ret;
+    int fd, ret, opt;
     unsigned int cmd;
     unsigned int arg;
+    int out;
+    unsigned long long ticks;
     char *filename;
+    char *script = NULL;
+    int repeat = 1;
+    unsigned int period_us = 0;
+    unsigned long long loops = 10000;
     unsigned char str[100];
+    struct timer_stats stats;
+    struct timer_chan chan;
+    struct timer_chan_stats chan_stats;
 
-    if(argc != 2) {
+    /*
+    * 不带选项时为交互模式，-f指定命令脚本，-n指定脚本重复提交的次数
+    * -t指定周期(us)进入延迟测试，-l指定测试的到期次数
+    */
+    while((opt = getopt(argc, argv, "f:n:t:l:")) != -1) {
+        if(opt == 'f') {
+            script = optarg;
+        } else if(opt == 'n') {
+            repeat = atoi(optarg);
+        } else if(opt == 't') {
+            period_us = strtoul(optarg, NULL, 0);
+        } else if(opt == 'l') {
+            loops = strtoull(optarg, NULL, 0);
+        } else {
+            printf("Usage: %s [-f script [-n repeat]] [-t period_us [-l loops]] /dev/timerdev\r\n", argv[0]);
+            return -1;
+        }
+    }
+    if(optind != argc - 1 || repeat < 1) {
         printf("Error Usage!\r\n");
         return -1;
     }
-    filename = argv[1];
+    filename = argv[optind];
 
     fd = open(filename, O_RDWR);
     if(fd < 0) {
@@ -31,6 +258,17 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if(script) {
+        ret = script_run(fd, script, repeat);
+        close(fd);
+        return ret < 0 ? -1 : 0;
+    }
+    if(period_us) {
+        ret = bench_run(fd, period_us, loops);
+        close(fd);
+        return ret;
+    }
+
     while(1) {
         printf("Input CMD:");
         /*
@@ -55,6 +293,98 @@ int main(int argc, char *argv[])
             if(ret != 1) {
                 gets(str);
             }
+        } else if (cmd == 4) {
+            /* 微秒周期，使用高精度定时器 */
+            cmd = SETPERIOD_US_CMD;
+            printf("Input Timer Period(us):");
+            ret = scanf("%d", &arg);
+            if(ret != 1) {
+                gets(str);
+            }
+        } else if (cmd == 5) {
+            /* 到期次数、错过的周期和最大延迟 */
+            if(ioctl(fd, GETSTATS_CMD, &stats) == 0) {
+                printf("ticks=%llu overruns=%llu last_late=%lluns max_late=%lluns\r\n",
+                       stats.ticks, stats.overruns, stats.last_late_ns, stats.max_late_ns);
+                if(stats.work_toggles || stats.work_dropped)
+                    printf("worker: toggles=%llu dropped=%llu last=%lluns max=%lluns avg=%lluns\r\n",
+                           stats.work_toggles, stats.work_dropped, stats.last_toggle_ns,
+                           stats.max_toggle_ns, stats.avg_toggle_ns);
+                /* 自己唤醒CPU的次数和合并掉的次数，用来比较slack和严格模式 */
+                printf("wakeups=%llu coalesced=%llu wakeups/s=%llu.%03llu over %llums\r\n",
+                       stats.wakeups, stats.coalesced, stats.wakeups_mps / 1000,
+                       stats.wakeups_mps % 1000, stats.elapsed_ns / 1000000);
+            }
+            continue;
+        } else if (cmd == 6) {
+            /* 多通道模式，周期为0时停止该通道 */
+            printf("Input Channel and Period(us):");
+            ret = scanf("%u %u", &chan.chan, &chan.period_us);
+            if(ret != 2) {
+                gets(str);
+                continue;
+            }
+            if(ioctl(fd, SETCHAN_CMD, &chan) < 0)
+                printf("set channel %u failed!\r\n", chan.chan);
+            continue;
+        } else if (cmd == 7) {
+            if(ioctl(fd, GETCHANSTATS_CMD, &chan_stats) == 0) {
+                printf("channels=%u active=%u wakeups=%llu toggles=%llu overruns=%llu\r\n",
+                       chan_stats.channels, chan_stats.active, chan_stats.wakeups,
+                       chan_stats.toggles, chan_stats.overruns);
+            }
+            continue;
+        } else if (cmd == 8) {
+            /* 每个打开的文件有自己的定时器，选择驱动led-gpio中的哪个输出，-1为不驱动 */
+            printf("Input Output Index:");
+            ret = scanf("%d", &out);
+            if(ret != 1) {
+                gets(str);
+                continue;
+            }
+            if(ioctl(fd, SETOUTPUT_CMD, out) < 0)
+                printf("output %d is busy or invalid!\r\n", out);
+            continue;
+        } else if (cmd == 11) {
+            /* read跟随的输出，-1为本文件自己的定时器 */
+            printf("Input Watch Output(-1 for own timer):");
+            ret = scanf("%d", &out);
+            if(ret != 1) {
+                gets(str);
+                continue;
+            }
+            if(ioctl(fd, WATCH_CMD, out) < 0)
+                printf("output %d is invalid!\r\n", out);
+            continue;
+        } else if (cmd == 12) {
+            /* 阻塞到下一次到期，返回上次read之后的到期次数 */
+            if(read(fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+                printf("ticks=%llu\r\n", ticks);
+            continue;
+        } else if (cmd == 13) {
+            /* 允许推迟到期的时间，0为严格模式 */
+            cmd = SETSLACK_CMD;
+            printf("Input Timer Slack(us):");
+            ret = scanf("%d", &arg);
+            if(ret != 1) {
+                gets(str);
+            }
+        } else if (cmd == 9) {
+            /* worker线程的SCHED_FIFO优先级，需要root */
+            cmd = SETPRIO_CMD;
+            printf("Input Worker Priority(1-99):");
+            ret = scanf("%d", &arg);
+            if(ret != 1) {
+                gets(str);
+            }
+        } else if (cmd == 10) {
+            /* 1:翻转交给worker线程 0:在定时器回调中翻转 */
+            cmd = SETWORKER_CMD;
+            printf("Input Worker Mode(0/1):");
+            ret = scanf("%d", &arg);
+            if(ret != 1) {
+                gets(str);
+            }
         }
         ioctl(fd, cmd, arg);
     }
@@ -1,7 +1,8 @@
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/delay.h>
-#include <linux/ide.h>
+#include <linux/version.h>
+#include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/errno.h>
@@ -12,92 +13,1090 @@
 #include <linux/of_address.h>
 #include <linux/of_gpio.h>
 #include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
 #include <linux/semaphore.h>
 #include <linux/of_irq.h>
 #include <linux/irq.h>
-#include <asm/mach/map.h>
-#include <asm/uaccess.h>
+#include <linux/interrupt.h>
+#include <linux/sched.h>
+#include <linux/capability.h>
+#include <linux/input.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/eventfd.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/seqlock.h>
+#include <net/genetlink.h>
+#include <linux/uaccess.h>
 #include <asm/io.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#include <uapi/linux/sched/types.h>
+#endif
 
 #define KEYIRQ_CNT      1
 #define KEYIRQ_NAME     "keyirq"
 #define KEY0VALUE       0X01
-#define INVAKEY         0XFF
-#define KEY_NUM         1           /* 按键数量 */
+#define KEY_NUM         1           /* 按键数量，按键电平用u32位图表示，不能超过32 */
+#define GPIO_PSR        0X08        /* i.MX GPIO的PSR寄存器，一次读出一组32个引脚的电平 */
+
+#define DEBOUNCE_MIN_US     100         /* 消抖时间下限(us) */
+#define DEBOUNCE_DEF_US     10000       /* 默认消抖时间10ms */
+#define IRQ_PRIO_DEF        50          /* 中断线程默认的SCHED_FIFO优先级，与内核默认值相同 */
+
+/*
+* 中断风暴抑制: 一个统计窗口内的边沿数超过storm_rate对应的值时关闭中断，
+* 改为每STORM_POLL_MS采样一次，连续STORM_SETTLE_SAMPLES次电平相同后恢复中断
+*/
+/*
+* 默认阈值，边沿数/秒，0表示不抑制
+* 一次带抖动的按下加松开约几十个边沿，连续快速按键也远低于每个窗口500个，只有真正的风暴才会触发
+*/
+#define STORM_RATE_DEF      5000
+#define STORM_RATE_MAX      1000000
+#define STORM_WINDOW_MS     100
+#define STORM_POLL_MS       20
+#define STORM_SETTLE_SAMPLES    5
+
+/* arg分别指向struct key_debounce和struct key_latency */
+#define SETDEBOUNCE_CMD     (_IOW(0XEF, 0X1, struct key_debounce))
+#define GETLATENCY_CMD      (_IOWR(0XEF, 0X2, struct key_latency))
+#define SETPRIO_CMD         (_IO(0XEF, 0X3))    /* arg为优先级1~99，需要CAP_SYS_NICE */
+#define SETSTORM_CMD        (_IO(0XEF, 0X4))    /* arg为风暴阈值(边沿数/秒)，0关闭抑制 */
+#define SETEVENTFD_CMD      (_IO(0XEF, 0X5))    /* arg为eventfd，-1取消注册 */
+#define SETMASK_CMD         (_IO(0XEF, 0X6))    /* arg为read要返回的事件类型掩码，1 << KEY_EV_xxx */
+#define SETGESTURE_CMD      (_IOW(0XEF, 0X7, struct key_gesture))
+
+/* 设置某个按键的消抖时间 */
+struct key_debounce {
+    unsigned int key;           /* 按键号 */
+    unsigned int us;            /* 消抖时间(us) */
+};
+
+/*
+* 某个按键的手势识别参数，单位ms，为0时关闭对应的手势，全部为0时不识别手势
+* long_ms: 按住超过这个时间产生长按事件
+* double_ms: 松开后这个时间内再次按下产生双击事件
+* repeat_ms: 长按之后每隔这个时间产生一次重复事件
+*/
+struct key_gesture {
+    unsigned int key;
+    unsigned int long_ms;
+    unsigned int double_ms;
+    unsigned int repeat_ms;
+};
+
+/* 按下到上报事件的延时统计，从一串抖动的第一个边沿开始计算 */
+struct key_latency {
+    unsigned int key;
+    unsigned int last_us;
+    unsigned int max_us;
+    unsigned int avg_us;
+    unsigned int count;
+};
+
+/*
+* log2延时直方图，第n格统计[2^(n-1), 2^n)us的样本，第0格为0us
+* 最后一格同时包含所有更大的值
+*/
+#define HIST_BUCKETS        24
+
+enum {
+    HIST_IRQ_DEBOUNCE,          /* 硬中断 -> 消抖完成 */
+    HIST_DEBOUNCE_READ,         /* 消抖完成 -> copy_to_user */
+    HIST_IRQ_READ,              /* 硬中断 -> copy_to_user，端到端延时 */
+    HIST_NUM,
+};
+
+struct keyirq_hist {
+    unsigned int bucket[HIST_BUCKETS];
+    unsigned int count;
+    unsigned int max_us;
+    u64 sum_us;
+};
+
+/* debugfs中导出的计数 */
+struct keyirq_stats {
+    unsigned int events;        /* 消抖后上报的事件数 */
+    unsigned int spurious;      /* 消抖后电平没有变化的抖动次数 */
+    unsigned int drops;         /* read用户读得太慢，事件在环中被覆盖的次数 */
+    unsigned int reads;         /* 成功读走的事件数 */
+    unsigned int gestures;      /* 产生的手势事件数 */
+    unsigned int nl_sent;       /* 组播出去的netlink消息数 */
+    unsigned int nl_errors;     /* 分配或组播失败的netlink消息数 */
+    unsigned int scans;         /* 消抖扫描次数 */
+    unsigned int reg_reads;     /* 扫描时读PSR寄存器的次数 */
+    unsigned int pin_reads;     /* 扫描时逐个调用gpio_get_value的次数 */
+    unsigned int storms;        /* 进入轮询模式的次数 */
+    unsigned int storm_polls;   /* 轮询模式下的采样次数 */
+    u64 storm_ns;               /* 处于轮询模式的总时间 */
+};
+
+/*
+* mmap事件环，映射布局为: 第0页是控制页，之后是RING_ENTRIES个struct key_event
+* 与perf一样单生产者: 内核只写head，用户只写tail，tail追不上时新事件不发布到映射页并计入lost，
+* 只有映射的用户会丢事件，read、eventfd和netlink不受影响
+* 没有进程映射时内核让tail跟随head，映射后看到的是空环
+* 映射的页用户可以随意改写，内核只往里面发布，事件的原始记录和写位置保存在内核的log中，
+* read、poll和netlink都从log中取，每个打开的文件有自己的读位置，事件只写一次
+*/
+#define READ_BATCH          32                  /* read一次最多取走的事件数 */
+#define RING_VERSION        1
+#define RING_ENTRIES        1024                /* 必须是2的幂 */
+#define RING_DATA_SIZE      (RING_ENTRIES * sizeof(struct key_event))
+#define RING_MMAP_SIZE      (PAGE_SIZE + PAGE_ALIGN(RING_DATA_SIZE))
+
+/* 环中的一个事件记录，16字节 */
+struct key_event {
+    __u64 time_ns;              /* 消抖完成的时间，CLOCK_MONOTONIC */
+    __u32 seq;                  /* 事件序号，连续递增 */
+    __u16 code;                 /* input按键码 */
+    __u8 key;                   /* 按键号 */
+    __u8 value;                 /* 事件类型，KEY_EV_xxx */
+};
+
+/* 内核中的事件记录，用户不可见 */
+struct key_record {
+    struct key_event event;
+    u64 irq_ns;                 /* 硬中断时间，手势等没有边沿的事件为0 */
+};
+
+/* struct key_event.value，0~2与input子系统的按键值含义一致 */
+#define KEY_EV_RELEASE      0
+#define KEY_EV_PRESS        1
+#define KEY_EV_REPEAT       2           /* 长按之后的自动重复 */
+#define KEY_EV_LONG         3           /* 长按 */
+#define KEY_EV_DOUBLE       4           /* 双击，在第二次按下时产生 */
+#define KEY_EV_NUM          5
+#define KEY_EV_MASK_ALL     ((1 << KEY_EV_NUM) - 1)
+
+struct key_ring_ctrl {
+    __u32 version;
+    __u32 entries;              /* 记录个数 */
+    __u32 entry_size;           /* 每个记录的字节数 */
+    __u32 data_offset;          /* 记录区相对映射起始地址的偏移 */
+    __u32 head;                 /* 内核写，下一个要写入的位置，自由增长 */
+    __u32 tail;                 /* 用户写，下一个要读取的位置，自由增长 */
+    __u32 lost;                 /* 环满丢弃的事件数 */
+    __u32 reserved;
+};
+
+/*
+* generic netlink: 族名"keyirq"，每个消抖后的事件在"events"组中组播一次
+* 订阅者通过CTRL_CMD_GETFAMILY得到族号和组号
+*/
+#define KEYIRQ_GENL_NAME    KEYIRQ_NAME
+#define KEYIRQ_GENL_VERSION 1
+#define KEYIRQ_GENL_MCGRP   "events"
+
+enum {
+    KEYIRQ_C_UNSPEC,
+    KEYIRQ_C_EVENT,             /* 内核->用户，一个按键事件 */
+};
+
+enum {
+    KEYIRQ_A_UNSPEC,
+    KEYIRQ_A_TIME,              /* u64，消抖完成时间(ns)，CLOCK_MONOTONIC */
+    KEYIRQ_A_SEQ,               /* u32，与mmap环中的序号一致 */
+    KEYIRQ_A_CODE,              /* u32，input按键码 */
+    KEYIRQ_A_KEY,               /* u8，按键号 */
+    KEYIRQ_A_VALUE,             /* u8，事件类型，KEY_EV_xxx */
+    KEYIRQ_A_PAD,               /* 4.7以后的内核用来对齐u64属性 */
+    __KEYIRQ_A_MAX,
+};
+#define KEYIRQ_A_MAX        (__KEYIRQ_A_MAX - 1)
+
+/*
+* 开发板上是4.1内核，keystress.sh在x86主机上按当前内核编译本驱动，
+* 这里把4.1之后改过的接口统一成一个名字
+*/
+#ifndef MAX_USER_RT_PRIO
+#define MAX_USER_RT_PRIO    MAX_RT_PRIO         /* 5.13删除 */
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+#define keyirq_nla_size_u64()               nla_total_size_64bit(sizeof(u64))
+#define keyirq_nla_put_u64(skb, type, val)  nla_put_u64_64bit(skb, type, val, KEYIRQ_A_PAD)
+#else
+#define keyirq_nla_size_u64()               nla_total_size(sizeof(u64))
+#define keyirq_nla_put_u64(skb, type, val)  nla_put_u64(skb, type, val)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define keyirq_class_create(name)   class_create(name)
+#else
+#define keyirq_class_create(name)   class_create(THIS_MODULE, name)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define keyirq_eventfd_signal(ctx)  eventfd_signal(ctx)
+#else
+#define keyirq_eventfd_signal(ctx)  eventfd_signal(ctx, 1)
+#endif
+
+static void keyirq_hrtimer_setup(struct hrtimer *timer, enum hrtimer_restart (*function)(struct hrtimer *))
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(timer, function, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    timer->function = function;
+#endif
+}
+
+/* 5.9以后sched_setscheduler不再导出给模块 */
+static int keyirq_set_fifo(int prio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+    struct sched_attr attr = {
+        .sched_policy = SCHED_FIFO,
+        .sched_priority = prio,
+    };
+
+    return sched_setattr_nocheck(current, &attr);
+#else
+    struct sched_param param = { .sched_priority = prio };
+
+    return sched_setscheduler(current, SCHED_FIFO, &param);
+#endif
+}
 
-/* 中断IO描述结构体 */
+/* 手势状态机的状态 */
+enum {
+    GESTURE_IDLE,
+    GESTURE_HELD,               /* 第一次按下，等待长按 */
+    GESTURE_LONG,               /* 已经产生长按，按住期间自动重复 */
+    GESTURE_WAIT_DOUBLE,        /* 短按松开，等待第二次按下 */
+    GESTURE_DOUBLE,             /* 双击的第二次按下，等待松开 */
+};
+
+/* 同一组GPIO的按键共用一次PSR读取 */
+struct key_bank {
+    struct device_node *np;     /* GPIO控制器节点 */
+    void __iomem *base;         /* GPIO控制器寄存器 */
+};
+
+struct keyirq_dev;
+
+/*
+* 中断IO描述结构体
+* 每个按键独占cache line，硬中断只访问开头的几个字段，中断线程的字段紧随其后，
+* 初始化和ioctl才用到的字段放在最后
+*/
 struct irq_keydesc {
+    /* 硬中断 */
+    seqcount_t edge_seq;                        /* 硬中断是下面三个字段唯一的写者 */
+    u64 edge_ns;                                /* 这一串抖动第一个边沿的时间，只用于统计延时 */
+    u64 last_ns;                                /* 最后一个边沿的时间 */
+    unsigned int edges;                         /* 边沿计数，每个边沿加1 */
+    unsigned int done_edges;                    /* 上一次上报时的edges，不相等说明有边沿等待消抖 */
+    struct hrtimer debounce_timer;              /* 每个边沿重新启动，最后一个边沿之后安静debounce_us才到期 */
+    u64 win_start_ns;                           /* 风暴统计窗口的起始时间 */
+    unsigned int win_edges;                     /* 当前窗口内的边沿数 */
+    bool polling;                               /* 处于风暴轮询模式，中断已关闭 */
+    struct keyirq_dev *dev;
+
+    /* 中断线程 */
+    unsigned char state;                        /* 上一次消抖后的IO电平 */
+    int bank;                                   /* 所在的GPIO组，-1表示逐个调用gpio_get_value */
+    u32 bit;                                    /* 在PSR中的位 */
+    int prio;                                   /* 中断线程当前使用的优先级 */
+    unsigned int debounce_us;                   /* 消抖时间(us) */
+    unsigned int lat_last_us;
+    unsigned int lat_max_us;
+    u64 lat_sum_us;
+    unsigned int lat_cnt;
+    int gesture;                                /* 手势状态，GESTURE_xxx，由dev->lock保护 */
+    u64 gesture_deadline_ns;                    /* gesture_timer本次应该到期的时间 */
+    unsigned int long_ms;                       /* 手势参数，见struct key_gesture */
+    unsigned int double_ms;
+    unsigned int repeat_ms;
+    unsigned int code;                          /* 上报给input子系统的按键码 */
+    unsigned char value;
+
+    /* 风暴轮询、定时器和初始化 */
+    unsigned char poll_last;                    /* 轮询模式上一次采样的电平 */
+    unsigned int poll_stable;                   /* 轮询模式电平连续相同的次数 */
+    u64 storm_start_ns;
+    struct delayed_work poll_work;              /* 轮询模式的采样定时器 */
+    struct hrtimer gesture_timer;               /* 长按、双击窗口和自动重复的定时器 */
     int gpio;
     int irqnum;
-    unsigned char value;
     char name[10];
-    irqreturn_t (*handler) (int, void *);       /* 中断服务函数 */
-};
+    irqreturn_t (*handler) (int, void *);       /* 中断服务函数(上半部) */
+} ____cacheline_aligned;
 
+/*
+* 设备结构体，加载驱动时kzalloc分配
+* 中断和读路径访问的字段从cache line边界开始，注册用的字段放在后面另起一行
+*/
 struct keyirq_dev {
-    dev_t devid;
+    atomic_t storm_rate;                        /* 风暴阈值，边沿数/秒 */
+    atomic_t prio;                              /* 中断线程要使用的优先级 */
+    spinlock_t lock;                            /* 保护延时统计、直方图和计数 */
+    u32 seq;                                    /* 下一个事件的序号 */
+    u32 head;                                   /* log的写位置，自由增长，由lock保护 */
+    u32 map_head;                               /* mmap环的写位置，发布到ctrl->head，由lock保护 */
+    u32 map_lost;                               /* mmap环满丢弃的事件数，发布到ctrl->lost */
+    struct key_ring_ctrl *ctrl;                 /* ring的第0页，用户可写 */
+    struct key_event *events;                   /* ring的记录区，用户可写 */
+    unsigned long notify_pending;               /* bit0: notify_work已经排队 */
+    struct input_dev *inputdev;                 /* input设备，供evdev/libinput使用 */
+    wait_queue_head_t r_wait;                   /* poll等待队列 */
+    struct keyirq_stats stats;
+    struct mutex scan_lock;                     /* 串行化消抖扫描和上报 */
+    struct key_bank banks[KEY_NUM];
+    int nbanks;
+    struct irq_keydesc irqkeydesc[KEY_NUM];     /*按键描述数组*/
+    struct keyirq_hist hist[HIST_NUM];
+    struct key_record log[RING_ENTRIES];        /* 事件的原始记录，只在内核中使用 */
+    struct work_struct notify_work;             /* 组播netlink并通知所有eventfd */
+    u32 nl_cursor;                              /* netlink在环中的发送位置，只在notify_work中使用 */
+    struct mutex efd_lock;                      /* 保护efd_list */
+    struct list_head efd_list;                  /* 注册了eventfd的client */
+
+    /* 注册、open和mmap时使用 */
+    dev_t devid ____cacheline_aligned;
     struct cdev cdev;
     struct class *class;
     struct device *device;
     int major;
     int minor;
     struct device_node *nd;
-    atomic_t keyvalue;
-    atomic_t releasekey;
-    struct timer_list timer;
-    struct irq_keydesc irqkeydesc[KEY_NUM];     /*按键描述数组*/
-    unsigned char curkeynum;                    /* 当前按下的按键号 */
+    void *ring;                                 /* vmalloc_user分配的mmap区域 */
+    atomic_t ring_maps;                         /* 当前映射了ring的vma个数 */
+    struct dentry *debugfs;
+    bool genl_registered;                       /* generic netlink族注册成功 */
+} ____cacheline_aligned;
+
+/* 每次open分配一个，保存在filp->private_data中 */
+struct keyirq_client {
+    struct keyirq_dev *dev;
+    bool mapped;                                /* 映射过ring，poll按ring判断可读 */
+    u32 cursor;                                 /* read在环中的读位置，和head一样自由增长 */
+    unsigned int mask;                          /* read返回的事件类型，默认只有松开 */
+    struct eventfd_ctx *efd;                    /* 有新事件时通知的eventfd */
+    struct list_head efd_node;
 };
 
-struct keyirq_dev keyirq;
+static struct keyirq_dev *keyirq;
+
+/* 设备树没有linux,code属性时使用的按键码 */
+static const unsigned int key_codes[KEY_NUM] = { KEY_0 };
+
+static int irq_prio = IRQ_PRIO_DEF;
+module_param(irq_prio, int, 0444);
+MODULE_PARM_DESC(irq_prio, "SCHED_FIFO priority of the key irq threads (1-99)");
+
+static int storm_rate = STORM_RATE_DEF;
+module_param(storm_rate, int, 0444);
+MODULE_PARM_DESC(storm_rate, "edges per second above which a key falls back to polling, 0 disables");
 
+/* 不使用设备树时直接指定按键的GPIO编号，比如在x86上绑定gpio-sim做压力测试 */
+static int gpios[KEY_NUM];
+static int gpios_num;
+module_param_array(gpios, int, &gpios_num, 0444);
+MODULE_PARM_DESC(gpios, "gpio numbers of the keys, bypasses the /key device tree node");
+
+static const char * const hist_names[HIST_NUM] = {
+    "irq_to_debounce", "debounce_to_read", "irq_to_read",
+};
+
+/* 把一个延时样本加入直方图，调用者持有dev->lock */
+static void keyirq_hist_add(struct keyirq_hist *hist, u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    unsigned int n;
+
+    if(us > UINT_MAX)
+        us = UINT_MAX;
+    n = fls((unsigned int)us);
+    if(n >= HIST_BUCKETS)
+        n = HIST_BUCKETS - 1;
+    hist->bucket[n] ++;
+    hist->count ++;
+    hist->sum_us += us;
+    if(us > hist->max_us)
+        hist->max_us = us;
+}
+
+/*
+* 从映射页读回用户的tail，这是内核唯一从映射页读取的字段
+* 不在[map_head - RING_ENTRIES, map_head]之内的值按环满处理
+*/
+static u32 key_ring_tail(struct keyirq_dev *dev)
+{
+    u32 tail = READ_ONCE(dev->ctrl->tail);
+
+    if(dev->map_head - tail > RING_ENTRIES)
+        tail = dev->map_head - RING_ENTRIES;
+    return tail;
+}
+
+/*
+* 写入一个事件，调用者持有dev->lock
+* 先写入内核的log，再发布到mmap环
+* 发布时先写记录再更新head，用户读到head后一定能看到完整的记录
+*/
+static void key_ring_push(struct keyirq_dev *dev, const struct key_event *event, u64 edge_ns)
+{
+    struct key_ring_ctrl *ctrl = dev->ctrl;
+    struct key_record *rec = &dev->log[dev->head & (RING_ENTRIES - 1)];
+    struct key_event *ev;
+    u32 head = dev->map_head;
+    bool mapped = atomic_read(&dev->ring_maps) > 0;
+
+    rec->event = *event;
+    rec->irq_ns = edge_ns;
+    dev->head ++;
+
+    if(mapped) {
+        /* 与用户更新tail配对，保证读完记录之后才会被覆盖 */
+        smp_mb();
+        if(head - key_ring_tail(dev) >= RING_ENTRIES) {
+            WRITE_ONCE(ctrl->lost, ++ dev->map_lost);
+            return;
+        }
+    }
+
+    ev = &dev->events[head & (RING_ENTRIES - 1)];
+    *ev = *event;
+
+    smp_wmb();
+    dev->map_head = head + 1;
+    WRITE_ONCE(ctrl->head, head + 1);
+    if(!mapped)
+        WRITE_ONCE(ctrl->tail, head + 1);
+}
+
+static const struct genl_multicast_group keyirq_genl_mcgrps[] = {
+    { .name = KEYIRQ_GENL_MCGRP, },
+};
+
+static struct genl_family keyirq_genl_family = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+    .module = THIS_MODULE,
+    .mcgrps = keyirq_genl_mcgrps,
+    .n_mcgrps = ARRAY_SIZE(keyirq_genl_mcgrps),
+#else
+    .id = GENL_ID_GENERATE,
+#endif
+    .name = KEYIRQ_GENL_NAME,
+    .version = KEYIRQ_GENL_VERSION,
+    .maxattr = KEYIRQ_A_MAX,
+};
+
+/* 把一个事件组播到events组，没有订阅者时直接返回 */
+static void keyirq_genl_send(struct keyirq_dev *dev, const struct key_event *event)
+{
+    struct sk_buff *skb;
+    void *hdr;
+    int ret;
+    unsigned long flags;
+
+    skb = genlmsg_new(keyirq_nla_size_u64() + 2 * nla_total_size(sizeof(u32)) +
+                      2 * nla_total_size(sizeof(u8)), GFP_KERNEL);
+    if(skb == NULL)
+        goto err;
+
+    hdr = genlmsg_put(skb, 0, 0, &keyirq_genl_family, 0, KEYIRQ_C_EVENT);
+    if(hdr == NULL)
+        goto err_free;
+    if(keyirq_nla_put_u64(skb, KEYIRQ_A_TIME, event->time_ns) ||
+       nla_put_u32(skb, KEYIRQ_A_SEQ, event->seq) ||
+       nla_put_u32(skb, KEYIRQ_A_CODE, event->code) ||
+       nla_put_u8(skb, KEYIRQ_A_KEY, event->key) ||
+       nla_put_u8(skb, KEYIRQ_A_VALUE, event->value))
+        goto err_free;
+    genlmsg_end(skb, hdr);
+
+    /* 没有订阅者时返回-ESRCH，不算错误 */
+    ret = genlmsg_multicast(&keyirq_genl_family, skb, 0, 0, GFP_KERNEL);
+    spin_lock_irqsave(&dev->lock, flags);
+    if(ret == 0)
+        dev->stats.nl_sent ++;
+    else if(ret != -ESRCH)
+        dev->stats.nl_errors ++;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return;
+
+err_free:
+    nlmsg_free(skb);
+err:
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->stats.nl_errors ++;
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/* 生成一个事件并写入环，调用者持有dev->lock */
+static void key_push_event(struct keyirq_dev *dev, struct irq_keydesc *keydesc,
+                           unsigned char type, u64 ns, u64 edge_ns)
+{
+    struct key_event event;
+
+    event.time_ns = ns;
+    event.seq = dev->seq ++;
+    event.code = keydesc->code;
+    event.key = keydesc - dev->irqkeydesc;
+    event.value = type;
+
+    /* 事件只写入环一次，所有读者共享 */
+    key_ring_push(dev, &event, edge_ns);
+}
+
+/* 新事件写入环之后调用，可以在任何上下文中调用 */
+static void keyirq_kick(struct keyirq_dev *dev)
+{
+    /* 唤醒poll，read和mmap的用户都在这里等待 */
+    wake_up_interruptible(&dev->r_wait);
+
+    /*
+    * netlink和eventfd的通知合并: notify_work还没运行时产生的事件只通知一次
+    * work开始运行时才清除标志，之后的事件再排队一次
+    */
+    if(!test_and_set_bit(0, &dev->notify_pending))
+        queue_work(system_highpri_wq, &dev->notify_work);
+}
+
+/* 启动手势定时器，调用者持有dev->lock */
+static void key_gesture_arm(struct irq_keydesc *keydesc, unsigned int ms)
+{
+    keydesc->gesture_deadline_ns = ktime_get_ns() + (u64)ms * NSEC_PER_MSEC;
+    hrtimer_start(&keydesc->gesture_timer, ms_to_ktime(ms), HRTIMER_MODE_REL);
+}
+
+/*
+* 手势状态机的输入，每次消抖后的按下/松开调用一次，调用者持有dev->lock
+* 定时器回调可能正在等待dev->lock，所以这里只能用hrtimer_try_to_cancel，
+* 过期的回调通过gesture_deadline_ns识别
+*/
+static void key_gesture_update(struct keyirq_dev *dev, struct irq_keydesc *keydesc,
+                               bool pressed, u64 ns)
+{
+    if(!keydesc->long_ms && !keydesc->double_ms)
+        return;
+
+    hrtimer_try_to_cancel(&keydesc->gesture_timer);
+    keydesc->gesture_deadline_ns = U64_MAX;
+
+    if(pressed) {
+        if(keydesc->gesture == GESTURE_WAIT_DOUBLE) {
+            key_push_event(dev, keydesc, KEY_EV_DOUBLE, ns, 0);
+            dev->stats.gestures ++;
+            keydesc->gesture = GESTURE_DOUBLE;
+        } else {
+            keydesc->gesture = GESTURE_HELD;
+            if(keydesc->long_ms)
+                key_gesture_arm(keydesc, keydesc->long_ms);
+        }
+    } else {
+        if(keydesc->gesture == GESTURE_HELD && keydesc->double_ms) {
+            keydesc->gesture = GESTURE_WAIT_DOUBLE;
+            key_gesture_arm(keydesc, keydesc->double_ms);
+        } else {
+            keydesc->gesture = GESTURE_IDLE;
+        }
+    }
+}
+
+/* 手势定时器到期: 长按、自动重复或者双击窗口结束，运行在硬中断上下文 */
+static enum hrtimer_restart key_gesture_timer(struct hrtimer *timer)
+{
+    struct irq_keydesc *keydesc = container_of(timer, struct irq_keydesc, gesture_timer);
+    struct keyirq_dev *dev = keydesc->dev;
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+    unsigned long flags;
+    bool pushed = false;
+    u64 now = ktime_get_ns();
+
+    spin_lock_irqsave(&dev->lock, flags);
+    /* 状态已经被新的按下/松开改变，这是一次过期的回调 */
+    if(now < keydesc->gesture_deadline_ns) {
+        spin_unlock_irqrestore(&dev->lock, flags);
+        return HRTIMER_NORESTART;
+    }
+
+    switch(keydesc->gesture) {
+    case GESTURE_HELD:
+        key_push_event(dev, keydesc, KEY_EV_LONG, now, 0);
+        keydesc->gesture = GESTURE_LONG;
+        pushed = true;
+        break;
+    case GESTURE_LONG:
+        key_push_event(dev, keydesc, KEY_EV_REPEAT, now, 0);
+        pushed = true;
+        break;
+    case GESTURE_WAIT_DOUBLE:
+        keydesc->gesture = GESTURE_IDLE;
+        break;
+    default:
+        break;
+    }
+
+    if(pushed) {
+        dev->stats.gestures ++;
+        /* 按住期间按固定周期重复，用hrtimer_forward避免累积误差 */
+        if(keydesc->gesture == GESTURE_LONG && keydesc->repeat_ms) {
+            hrtimer_forward_now(timer, ms_to_ktime(keydesc->repeat_ms));
+            keydesc->gesture_deadline_ns = ktime_to_ns(hrtimer_get_expires(timer));
+            restart = HRTIMER_RESTART;
+        }
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if(pushed)
+        keyirq_kick(dev);
+    return restart;
+}
+
+/*
+* 把环中nl_cursor之后的事件组播出去，只在notify_work中调用
+* 手势事件在硬中断中产生，不能直接组播，所以统一在这里发送
+*/
+static void keyirq_genl_flush(struct keyirq_dev *dev)
+{
+    struct key_event batch[READ_BATCH];
+    unsigned int n, i;
+    unsigned long flags;
+    bool listeners;
+    u32 head;
+
+    if(!dev->genl_registered)
+        return;
+    listeners = genl_has_listeners(&keyirq_genl_family, &init_net, 0);
+
+    do {
+        n = 0;
+        spin_lock_irqsave(&dev->lock, flags);
+        head = dev->head;
+        if(!listeners) {
+            dev->nl_cursor = head;
+        } else if(head - dev->nl_cursor > RING_ENTRIES) {
+            dev->stats.nl_errors += head - dev->nl_cursor - RING_ENTRIES;
+            dev->nl_cursor = head - RING_ENTRIES;
+        }
+        while(dev->nl_cursor != head && n < READ_BATCH)
+            batch[n ++] = dev->log[dev->nl_cursor ++ & (RING_ENTRIES - 1)].event;
+        spin_unlock_irqrestore(&dev->lock, flags);
+
+        for(i = 0; i < n; i ++)
+            keyirq_genl_send(dev, &batch[i]);
+    } while(n == READ_BATCH);
+}
+
+/*
+* 上半部只记录时间戳并启动消抖定时器，其余工作交给中断线程
+* 以IRQF_NO_THREAD申请，threadirqs或PREEMPT_RT下也在硬中断中运行，所以这里不能拿dev->lock
+*/
 static irqreturn_t key0_handler(int irq, void *dev_id)
 {
-    struct keyirq_dev *dev = (struct keyirq_dev *)dev_id;
+    struct irq_keydesc *keydesc = (struct irq_keydesc *)dev_id;
+    struct keyirq_dev *dev = keydesc->dev;
+    unsigned int rate, limit;
+    u64 now = ktime_get_ns();
+
+    /*
+    * 统计窗口内的边沿数
+    * 中断不是ONESHOT，线程和消抖定时器不会屏蔽中断线，每个边沿都会进入这里计数
+    */
+    if(now - keydesc->win_start_ns > (u64)STORM_WINDOW_MS * NSEC_PER_MSEC) {
+        keydesc->win_start_ns = now;
+        keydesc->win_edges = 0;
+    }
+    keydesc->win_edges ++;
+
+    rate = atomic_read(&dev->storm_rate);
+    limit = max_t(unsigned int, rate * STORM_WINDOW_MS / MSEC_PER_SEC, 1);
+    if(rate && keydesc->win_edges > limit) {
+        /* 中断风暴，关闭中断改为定时采样，等电平稳定后再打开 */
+        disable_irq_nosync(irq);
+        keydesc->polling = true;
+        keydesc->poll_stable = 0;
+        keydesc->poll_last = 0xff;
+        keydesc->storm_start_ns = now;
+        /* 轮询期间不再唤醒中断线程，等待消抖的边沿由轮询上报 */
+        hrtimer_try_to_cancel(&keydesc->debounce_timer);
+        schedule_delayed_work(&keydesc->poll_work, msecs_to_jiffies(STORM_POLL_MS));
+        return IRQ_HANDLED;
+    }
+
+    /* 记录这一串抖动的第一个边沿，用于计算按下到上报的延时 */
+    write_seqcount_begin(&keydesc->edge_seq);
+    if(keydesc->edges == READ_ONCE(keydesc->done_edges))
+        keydesc->edge_ns = now;
+    keydesc->last_ns = now;
+    keydesc->edges ++;
+    write_seqcount_end(&keydesc->edge_seq);
+
+    /*
+    * 消抖窗口从最后一个边沿开始计算，和以前的mod_timer一样每个边沿都重新启动
+    * 窗口内中断不屏蔽，中断线程由定时器唤醒
+    */
+    hrtimer_start(&keydesc->debounce_timer,
+                  ns_to_ktime((u64)READ_ONCE(keydesc->debounce_us) * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+    return IRQ_HANDLED;
+}
+
+/*
+* 消抖定时器到期，最后一个边沿之后已经安静了debounce_us，唤醒中断线程采样
+* irq_wake_thread只查找主action，强制线程化时主action的线程运行的是key0_handler，
+* 所以申请中断时用IRQF_NO_THREAD保证key_thread就是主action的线程
+*/
+static enum hrtimer_restart key_debounce_timer(struct hrtimer *timer)
+{
+    struct irq_keydesc *keydesc = container_of(timer, struct irq_keydesc, debounce_timer);
+
+    irq_wake_thread(keydesc->irqnum, keydesc);
+    return HRTIMER_NORESTART;
+}
+
+/*
+* 上报一次消抖后的电平，中断线程和风暴轮询共用
+* edge_ns为这一串抖动的第一个边沿时间，为0时不统计延时
+*/
+static void key_report(struct keyirq_dev *dev, struct irq_keydesc *keydesc,
+                       unsigned char value, u64 edge_ns)
+{
+    unsigned int lat_us;
+    unsigned long flags;
+    u64 done_ns = ktime_get_ns();
+
+    /* 电平和上次一样说明只是抖动，不上报 */
+    if(value == keydesc->state) {
+        spin_lock_irqsave(&dev->lock, flags);
+        dev->stats.spurious ++;
+        spin_unlock_irqrestore(&dev->lock, flags);
+        return;
+    }
+    keydesc->state = value;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    /* 统计从第一个边沿到事件产生的延时 */
+    if(edge_ns) {
+        lat_us = div_u64(done_ns - edge_ns, NSEC_PER_USEC);
+        keydesc->lat_last_us = lat_us;
+        if(lat_us > keydesc->lat_max_us)
+            keydesc->lat_max_us = lat_us;
+        keydesc->lat_sum_us += lat_us;
+        keydesc->lat_cnt ++;
+        keyirq_hist_add(&dev->hist[HIST_IRQ_DEBOUNCE], done_ns - edge_ns);
+    }
+    dev->stats.events ++;
+
+    key_push_event(dev, keydesc, value ? KEY_EV_RELEASE : KEY_EV_PRESS, done_ns, edge_ns);
+    key_gesture_update(dev, keydesc, !value, done_ns);
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    keyirq_kick(dev);
+
+    /* 同时通过input子系统上报，按下为1，松开为0 */
+    input_report_key(dev->inputdev, keydesc->code, !value);
+    input_sync(dev->inputdev);
+}
+
+/*
+* 读取所有按键的电平，第i位对应第i个按键
+* 同一组GPIO的按键只读一次PSR，没有映射寄存器的按键(比如I2C扩展的GPIO)逐个读取
+*/
+static u32 keyirq_sample(struct keyirq_dev *dev)
+{
+    u32 psr[KEY_NUM];
+    u32 levels = 0;
+    unsigned long flags;
+    int i, pins = 0;
+    struct irq_keydesc *keydesc;
+
+    for(i = 0; i < dev->nbanks; i ++)
+        psr[i] = readl(dev->banks[i].base + GPIO_PSR);
+
+    for(i = 0; i < KEY_NUM; i ++) {
+        keydesc = &dev->irqkeydesc[i];
+        if(keydesc->bank >= 0) {
+            if(psr[keydesc->bank] & keydesc->bit)
+                levels |= BIT(i);
+        } else {
+            if(gpio_get_value_cansleep(keydesc->gpio))
+                levels |= BIT(i);
+            pins ++;
+        }
+    }
+
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->stats.scans ++;
+    dev->stats.reg_reads += dev->nbanks;
+    dev->stats.pin_reads += pins;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return levels;
+}
+
+/* 有边沿等待消抖 */
+static bool key_pending(struct irq_keydesc *keydesc)
+{
+    return READ_ONCE(keydesc->edges) != keydesc->done_edges;
+}
+
+/*
+* 消抖扫描，调用者持有scan_lock
+* 一次采样之后，所有有边沿等待消抖、并且最后一个边沿之后已经安静了debounce_us的按键一起上报，
+* 它们的中断线程随后发现没有等待的边沿就直接返回
+* 还在抖动的按键，或者采样期间又来了边沿的按键这次不上报，等重新启动的消抖定时器
+*/
+static void keyirq_scan(struct keyirq_dev *dev)
+{
+    unsigned int edges[KEY_NUM];
+    u64 edge_ns[KEY_NUM], last_ns[KEY_NUM];
+    unsigned int seq;
+    u32 levels;
+    u64 now;
+    int i;
+    struct irq_keydesc *keydesc;
+
+    for(i = 0; i < KEY_NUM; i ++) {
+        keydesc = &dev->irqkeydesc[i];
+        do {
+            seq = read_seqcount_begin(&keydesc->edge_seq);
+            edges[i] = keydesc->edges;
+            edge_ns[i] = keydesc->edge_ns;
+            last_ns[i] = keydesc->last_ns;
+        } while(read_seqcount_retry(&keydesc->edge_seq, seq));
+    }
+    now = ktime_get_ns();
+    levels = keyirq_sample(dev);
+    smp_rmb();
+
+    for(i = 0; i < KEY_NUM; i ++) {
+        keydesc = &dev->irqkeydesc[i];
+        if(edges[i] == keydesc->done_edges || keydesc->polling ||
+           now < last_ns[i] + (u64)keydesc->debounce_us * NSEC_PER_USEC ||
+           READ_ONCE(keydesc->edges) != edges[i])
+            continue;
+        WRITE_ONCE(keydesc->done_edges, edges[i]);
+        key_report(dev, keydesc, !!(levels & BIT(i)), edge_ns[i]);
+    }
+}
+
+/*
+* 中断线程(下半部)，运行在独立的SCHED_FIFO内核线程中，不受软中断负载影响
+* 由消抖定时器唤醒，这时最后一个边沿之后已经安静了debounce_us
+*/
+static irqreturn_t key_thread(int irq, void *dev_id)
+{
+    int prio;
+    struct irq_keydesc *keydesc = (struct irq_keydesc *)dev_id;
+    struct keyirq_dev *dev = keydesc->dev;
 
-    dev->curkeynum = 0;
-    dev->timer.data = (volatile long)dev_id;    /* 传递给定时器中断的结构体首地址 */
-    /* 按键按下后10ms触发定时器中断 */
-    mod_timer(&dev->timer, jiffies + msecs_to_jiffies(10));
-    return IRQ_RETVAL(IRQ_HANDLED);
+    /* 优先级被修改后，由线程自己在下一次运行时生效 */
+    prio = atomic_read(&dev->prio);
+    if(prio != keydesc->prio) {
+        if(keyirq_set_fifo(prio) == 0)
+            keydesc->prio = prio;
+    }
+
+    /* 没有等待的边沿说明已经被其他按键的扫描一起处理了 */
+    mutex_lock(&dev->scan_lock);
+    if(key_pending(keydesc))
+        keyirq_scan(dev);
+    mutex_unlock(&dev->scan_lock);
+    return IRQ_HANDLED;
 }
 
-/* 定时器中断处理函数不加static，可供外部调用 */
-void timer_function(unsigned long arg)
+/*
+* 轮询模式的采样函数，电平连续稳定后上报最终状态并重新打开中断
+* 与NAPI类似，风暴期间中断一直关闭，只有这个定时采样在运行
+*/
+static void key_poll_work(struct work_struct *work)
 {
     unsigned char value;
-    unsigned char num;
+    unsigned long flags;
+    u64 now;
+    struct irq_keydesc *keydesc = container_of(to_delayed_work(work), struct irq_keydesc, poll_work);
+    struct keyirq_dev *dev = keydesc->dev;
+    bool first = keydesc->poll_last == 0xff;    /* 硬中断进入轮询时置0xff，风暴次数在这里统计 */
+
+    value = !!(keyirq_sample(dev) & BIT(keydesc - dev->irqkeydesc));
+    if(value == keydesc->poll_last) {
+        keydesc->poll_stable ++;
+    } else {
+        keydesc->poll_last = value;
+        keydesc->poll_stable = 0;
+    }
+
+    now = ktime_get_ns();
+    spin_lock_irqsave(&dev->lock, flags);
+    if(first)
+        dev->stats.storms ++;
+    dev->stats.storm_polls ++;
+    if(keydesc->poll_stable >= STORM_SETTLE_SAMPLES)
+        dev->stats.storm_ns += now - keydesc->storm_start_ns;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if(keydesc->poll_stable < STORM_SETTLE_SAMPLES) {
+        schedule_delayed_work(&keydesc->poll_work, msecs_to_jiffies(STORM_POLL_MS));
+        return;
+    }
+
+    /* 电平已稳定，退出轮询模式 */
+    mutex_lock(&dev->scan_lock);
+    key_report(dev, keydesc, value, 0);
+    mutex_unlock(&dev->scan_lock);
+    keydesc->win_start_ns = now;
+    keydesc->win_edges = 0;
+    /* 轮询期间中断关闭，之前等待消抖的边沿已经由上面的上报处理 */
+    WRITE_ONCE(keydesc->done_edges, keydesc->edges);
+    keydesc->polling = false;
+    enable_irq(keydesc->irqnum);
+}
+
+/* 每一批事件组播到netlink，并给每个注册的eventfd加1 */
+static void keyirq_notify_work(struct work_struct *work)
+{
+    struct keyirq_dev *dev = container_of(work, struct keyirq_dev, notify_work);
+    struct keyirq_client *client;
+
+    clear_bit(0, &dev->notify_pending);
+    /* 与keyirq_kick中先写环再置位配对，保证能看到这一批的所有事件 */
+    smp_mb__after_atomic();
+
+    keyirq_genl_flush(dev);
+
+    mutex_lock(&dev->efd_lock);
+    list_for_each_entry(client, &dev->efd_list, efd_node)
+        keyirq_eventfd_signal(client->efd);
+    mutex_unlock(&dev->efd_lock);
+}
+
+/* 注册input设备，每个按键对应一个EV_KEY按键码 */
+static int keyinput_init(void)
+{
+    unsigned char i;
+    int ret;
+
+    keyirq->inputdev = input_allocate_device();
+    if(keyirq->inputdev == NULL)
+        return -ENOMEM;
+
+    keyirq->inputdev->name = KEYIRQ_NAME;
+    keyirq->inputdev->phys = KEYIRQ_NAME "/input0";
+    keyirq->inputdev->id.bustype = BUS_HOST;
+    __set_bit(EV_KEY, keyirq->inputdev->evbit);
+    for(i = 0; i < KEY_NUM; i ++)
+        __set_bit(keyirq->irqkeydesc[i].code, keyirq->inputdev->keybit);
+
+    ret = input_register_device(keyirq->inputdev);
+    if(ret < 0) {
+        printk("register input device failed!\r\n");
+        input_free_device(keyirq->inputdev);
+        keyirq->inputdev = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+/*
+* 找到每个按键所在的GPIO控制器，i.MX的GPIO控制器映射寄存器后可以一次读出整组电平
+* 其他控制器保持bank为-1，扫描时逐个读取
+*/
+static void keybank_init(void)
+{
+    struct of_phandle_args args;
     struct irq_keydesc *keydesc;
-    struct keyirq_dev *dev = (struct keyirq_dev *)arg;
+    int i, b;
+
+    for(i = 0; i < KEY_NUM; i ++) {
+        keydesc = &keyirq->irqkeydesc[i];
+        keydesc->bank = -1;
+        if(keyirq->nd == NULL ||
+           of_parse_phandle_with_args(keyirq->nd, "key-gpio", "#gpio-cells", i, &args))
+            continue;
+        if(!of_device_is_compatible(args.np, "fsl,imx35-gpio") || args.args[0] >= 32) {
+            of_node_put(args.np);
+            continue;
+        }
 
-    num = dev->curkeynum;
-    keydesc = &dev->irqkeydesc[num];        /* 得到当前按下按键对应的按键数组 */
-    value = gpio_get_value(keydesc->gpio);
+        for(b = 0; b < keyirq->nbanks; b ++) {
+            if(keyirq->banks[b].np == args.np)
+                break;
+        }
+        if(b == keyirq->nbanks) {
+            keyirq->banks[b].base = of_iomap(args.np, 0);
+            if(keyirq->banks[b].base == NULL) {
+                of_node_put(args.np);
+                continue;
+            }
+            keyirq->banks[b].np = args.np;
+            keyirq->nbanks ++;
+        } else {
+            of_node_put(args.np);
+        }
+        keydesc->bank = b;
+        keydesc->bit = BIT(args.args[0]);
+    }
+    printk("keys in %d gpio bank(s)\r\n", keyirq->nbanks);
+}
+
+/* 释放keybank_init映射的寄存器 */
+static void keybank_exit(void)
+{
+    int i;
+
+    for(i = 0; i < keyirq->nbanks; i ++) {
+        iounmap(keyirq->banks[i].base);
+        of_node_put(keyirq->banks[i].np);
+    }
+    keyirq->nbanks = 0;
+}
+
+/*
+* 释放前n个按键的中断
+* disable_irq会等待中断线程运行结束，之后不会再进入轮询模式
+* 轮询采样停止后再释放中断
+*/
+static void keyio_free_irqs(int n)
+{
+    int i;
 
-    if(value == 0) {        /* 按键按下 */
-        atomic_set(&dev->keyvalue, keydesc->value);     /* 设置dev中的按键值 */
-    } else {                /* 按键松开 */
-        atomic_set(&dev->keyvalue, 0x80 | keydesc->value);
-        atomic_set(&dev->releasekey, 1);        /* 标记按键松开 */
+    for(i = 0; i < n; i ++) {
+        disable_irq(keyirq->irqkeydesc[i].irqnum);
+        hrtimer_cancel(&keyirq->irqkeydesc[i].debounce_timer);
+        cancel_delayed_work_sync(&keyirq->irqkeydesc[i].poll_work);
+        free_irq(keyirq->irqkeydesc[i].irqnum, &keyirq->irqkeydesc[i]);
+        hrtimer_cancel(&keyirq->irqkeydesc[i].gesture_timer);
     }
 }
 
+/* 申请GPIO和中断，失败时释放这里已经申请的所有资源 */
 static int keyio_init(void)
 {
     unsigned char i = 0;
     int ret = 0;
+    int irq;
 
-    keyirq.nd = of_find_node_by_path("/key");
-    if(keyirq.nd == NULL) {
-        printk("can't find node!\r\n");
+    if(gpios_num == 0) {
+        keyirq->nd = of_find_node_by_path("/key");
+        if(keyirq->nd == NULL) {
+            printk("can't find node!\r\n");
+            return -EINVAL;
+        }
+    } else if(gpios_num != KEY_NUM) {
+        printk("gpios needs %d entries!\r\n", KEY_NUM);
         return -EINVAL;
     }
 
     /* 提取GPIO */
     for (i = 0; i < KEY_NUM; i ++) {
-        // ??
-        keyirq.irqkeydesc[i].gpio = of_get_named_gpio(keyirq.nd, "key-gpio", i);
-        if(keyirq.irqkeydesc[i].gpio < 0) {
+        if(keyirq->nd)
+            keyirq->irqkeydesc[i].gpio = of_get_named_gpio(keyirq->nd, "key-gpio", i);
+        else
+            keyirq->irqkeydesc[i].gpio = gpios[i];
+        if(keyirq->irqkeydesc[i].gpio < 0) {
             printk("can't find key%d!\r\n", i);
             return -EINVAL;
         }
@@ -105,123 +1104,591 @@ static int keyio_init(void)
 
     /* 初始化key所用的IO，并设置成中断模式 */
     for (i = 0; i < KEY_NUM; i ++) {
-        memset(keyirq.irqkeydesc[i].name, 0, sizeof(keyirq.irqkeydesc[i].name));
-        sprintf(keyirq.irqkeydesc[i].name, "KEY%d", i);
-        gpio_request(keyirq.irqkeydesc[i].gpio, keyirq.irqkeydesc[i].name);
-        gpio_direction_input(keyirq.irqkeydesc[i].gpio);
-        // ??
-        keyirq.irqkeydesc[i].irqnum = irq_of_parse_and_map(keyirq.nd, i);
-#if 0
-        keyirq.irqkeydesc[i].irqnum = gpio_to_irq(keyirq.irqkeydesc[i].gpio);
-#endif
-        printk("key%d:gpio=%d, irqnum=%d\r\n", i, keyirq.irqkeydesc[i].gpio, keyirq.irqkeydesc[i].irqnum);
+        memset(keyirq->irqkeydesc[i].name, 0, sizeof(keyirq->irqkeydesc[i].name));
+        sprintf(keyirq->irqkeydesc[i].name, "KEY%d", i);
+        ret = gpio_request(keyirq->irqkeydesc[i].gpio, keyirq->irqkeydesc[i].name);
+        if(ret < 0) {
+            printk("key%d gpio request failed!\r\n", i);
+            goto err_gpio;
+        }
+        gpio_direction_input(keyirq->irqkeydesc[i].gpio);
+        if(keyirq->nd == NULL ||
+           of_property_read_u32_index(keyirq->nd, "linux,code", i, &keyirq->irqkeydesc[i].code))
+            keyirq->irqkeydesc[i].code = key_codes[i];
+        /* 没有设备树节点时从GPIO控制器得到中断号 */
+        if(keyirq->nd)
+            irq = irq_of_parse_and_map(keyirq->nd, i);
+        else
+            irq = gpio_to_irq(keyirq->irqkeydesc[i].gpio);
+        printk("key%d:gpio=%d, irqnum=%d\r\n", i, keyirq->irqkeydesc[i].gpio, irq);
+        /* irq_of_parse_and_map失败时返回0，gpio_to_irq返回负的错误码 */
+        if(irq <= 0) {
+            gpio_free(keyirq->irqkeydesc[i].gpio);
+            ret = irq < 0 ? irq : -EINVAL;
+            goto err_gpio;
+        }
+        keyirq->irqkeydesc[i].irqnum = irq;
     }
 
-    keyirq.irqkeydesc[0].handler = key0_handler;
-    keyirq.irqkeydesc[0].value = KEY0VALUE;
+    keyirq->irqkeydesc[0].handler = key0_handler;
+    keyirq->irqkeydesc[0].value = KEY0VALUE;
+
+    keybank_init();
+
+    /* input设备要在申请中断之前注册，中断线程会直接上报 */
+    ret = keyinput_init();
+    if(ret < 0)
+        goto err_bank;
 
+    /* 这些参数要在申请中断之前初始化，中断可能马上就会触发 */
     for(i = 0; i < KEY_NUM; i ++) {
-        ret = request_irq(  keyirq.irqkeydesc[i].irqnum, 
-                            keyirq.irqkeydesc[i].handler, 
-                            IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING, 
-                            keyirq.irqkeydesc[i].name, 
-                            &keyirq);
+        keyirq->irqkeydesc[i].dev = keyirq;
+        keyirq->irqkeydesc[i].debounce_us = DEBOUNCE_DEF_US;
+        keyirq->irqkeydesc[i].state = gpio_get_value_cansleep(keyirq->irqkeydesc[i].gpio);
+        keyirq->irqkeydesc[i].prio = 0;
+        INIT_DELAYED_WORK(&keyirq->irqkeydesc[i].poll_work, key_poll_work);
+        keyirq->irqkeydesc[i].gesture = GESTURE_IDLE;
+        keyirq_hrtimer_setup(&keyirq->irqkeydesc[i].gesture_timer, key_gesture_timer);
+        keyirq_hrtimer_setup(&keyirq->irqkeydesc[i].debounce_timer, key_debounce_timer);
+        seqcount_init(&keyirq->irqkeydesc[i].edge_seq);
+    }
+
+    /*
+    * dev_id传递按键描述结构体，中断函数中直接得到是哪个按键
+    * 不使用IRQF_ONESHOT，消抖窗口内的边沿也要进入硬中断重新启动窗口并计入风暴统计
+    * IRQF_NO_THREAD: 上半部不被强制线程化，消抖定时器才能用irq_wake_thread唤醒key_thread
+    */
+    for(i = 0; i < KEY_NUM; i ++) {
+        ret = request_threaded_irq( keyirq->irqkeydesc[i].irqnum, 
+                                    keyirq->irqkeydesc[i].handler, 
+                                    key_thread, 
+                                    IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING | IRQF_NO_THREAD, 
+                                    keyirq->irqkeydesc[i].name, 
+                                    &keyirq->irqkeydesc[i]);
         if(ret < 0) {
-            printk("irq %d request failed!\r\n", keyirq.irqkeydesc[i].irqnum);
-            return -EINVAL;
+            printk("irq %d request failed!\r\n", keyirq->irqkeydesc[i].irqnum);
+            goto err_irq;
         }
     }
 
-    init_timer(&keyirq.timer);
-    keyirq.timer.function = timer_function;
     return 0;
+
+err_irq:
+    keyio_free_irqs(i);
+    /* input_unregister_device会同时释放input设备 */
+    input_unregister_device(keyirq->inputdev);
+    keyirq->inputdev = NULL;
+    i = KEY_NUM;
+err_bank:
+    keybank_exit();
+err_gpio:
+    while(i --)
+        gpio_free(keyirq->irqkeydesc[i].gpio);
+    return ret;
 }
 
 static int keyirq_open(struct inode *inode, struct file *filp)
 {
-    filp->private_data = &keyirq;
+    struct keyirq_client *client;
+
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+    if(client == NULL)
+        return -ENOMEM;
+    client->dev = keyirq;
+    client->mask = 1 << KEY_EV_RELEASE;
+    /* 只读取open之后产生的事件 */
+    client->cursor = READ_ONCE(keyirq->head);
+    filp->private_data = client;
     return 0;
 }
 
+/* 注册或取消client的eventfd，fd小于0时只取消 */
+static int keyirq_set_eventfd(struct keyirq_client *client, int fd)
+{
+    struct keyirq_dev *dev = client->dev;
+    struct eventfd_ctx *efd = NULL, *old;
+
+    if(fd >= 0) {
+        efd = eventfd_ctx_fdget(fd);
+        if(IS_ERR(efd))
+            return PTR_ERR(efd);
+    }
+
+    mutex_lock(&dev->efd_lock);
+    old = client->efd;
+    if(old)
+        list_del(&client->efd_node);
+    client->efd = efd;
+    if(efd)
+        list_add_tail(&client->efd_node, &dev->efd_list);
+    mutex_unlock(&dev->efd_lock);
+
+    if(old)
+        eventfd_ctx_put(old);
+    return 0;
+}
+
+static int keyirq_release(struct inode *inode, struct file *filp)
+{
+    struct keyirq_client *client = filp->private_data;
+
+    keyirq_set_eventfd(client, -1);
+    kfree(client);
+    return 0;
+}
+
+/*
+* 把client的读位置移到下一个松开事件上，返回是否有松开事件可读，调用者持有dev->lock
+* 读位置落后超过环的大小时，最老的事件已被覆盖，跳到环中最老的事件
+*/
+static bool keyirq_client_pending(struct keyirq_client *client)
+{
+    struct keyirq_dev *dev = client->dev;
+    u32 head = dev->head;
+
+    if(head - client->cursor > RING_ENTRIES) {
+        dev->stats.drops += head - client->cursor - RING_ENTRIES;
+        client->cursor = head - RING_ENTRIES;
+    }
+    /* 跳过不关心的事件类型，默认和老的协议一样只上报松开事件 */
+    while(client->cursor != head &&
+          !(client->mask & (1 << dev->log[client->cursor & (RING_ENTRIES - 1)].event.value)))
+        client->cursor ++;
+    return client->cursor != head;
+}
+
+static bool keyirq_client_ready(struct keyirq_client *client)
+{
+    unsigned long flags;
+    bool ready;
+
+    spin_lock_irqsave(&client->dev->lock, flags);
+    ready = keyirq_client_pending(client);
+    spin_unlock_irqrestore(&client->dev->lock, flags);
+    return ready;
+}
+
+/*
+* 每个事件返回1字节，低4位为按键值，高4位为事件类型KEY_EV_xxx，一次最多返回cnt个
+* 松开事件的高4位为0，与老的协议相同
+* 没有事件时阻塞，O_NONBLOCK时返回-EAGAIN
+*/
 static ssize_t keyirq_read(struct file *filp, char __user *buf, size_t cnt, loff_t *offt)
 {
     int ret = 0;
-    unsigned char keyvalue = 0;
-    unsigned char releasekey = 0;
-    struct keyirq_dev *dev = (struct keyirq_dev *)filp->private_data;
-    keyvalue = atomic_read(&dev->keyvalue);
-    releasekey = atomic_read(&dev->releasekey);
-
-    if(releasekey) {
-        if(keyvalue & 0x80) {
-            keyvalue &= ~0x80;
-            ret = copy_to_user(buf, &keyvalue, sizeof(keyvalue));
-        } else {
-            // ??
-            goto data_error;
+    unsigned char keyvalue[READ_BATCH];
+    u64 done_ns[READ_BATCH], irq_ns[READ_BATCH];
+    unsigned int n = 0, i, idx;
+    unsigned long flags;
+    u64 now;
+    struct keyirq_client *client = filp->private_data;
+    struct keyirq_dev *dev = client->dev;
+
+    if(cnt == 0)
+        return 0;
+    cnt = min_t(size_t, cnt, READ_BATCH);
+
+    while(1) {
+        spin_lock_irqsave(&dev->lock, flags);
+        while(n < cnt && keyirq_client_pending(client)) {
+            idx = client->cursor & (RING_ENTRIES - 1);
+            keyvalue[n] = dev->irqkeydesc[dev->log[idx].event.key].value |
+                          (dev->log[idx].event.value << 4);
+            done_ns[n] = dev->log[idx].event.time_ns;
+            irq_ns[n] = dev->log[idx].irq_ns;
+            client->cursor ++;
+            n ++;
         }
-        atomic_set(&dev->releasekey, 0);
-    } else {
-        goto data_error;
+        spin_unlock_irqrestore(&dev->lock, flags);
+        if(n)
+            break;
+
+        if(filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(dev->r_wait, keyirq_client_ready(client));
+        if(ret)
+            return ret;
+    }
+
+    if(copy_to_user(buf, keyvalue, n))
+        return -EFAULT;
+
+    /* 事件送到用户空间的时间点 */
+    now = ktime_get_ns();
+    spin_lock_irqsave(&dev->lock, flags);
+    for(i = 0; i < n; i ++) {
+        dev->stats.reads ++;
+        keyirq_hist_add(&dev->hist[HIST_DEBOUNCE_READ], now - done_ns[i]);
+        if(irq_ns[i])
+            keyirq_hist_add(&dev->hist[HIST_IRQ_READ], now - irq_ns[i]);
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return n;
+}
+
+static long keyirq_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct keyirq_client *client = filp->private_data;
+    struct keyirq_dev *dev = client->dev;
+    struct irq_keydesc *keydesc;
+    struct key_debounce deb;
+    struct key_latency lat;
+    struct key_gesture ges;
+    unsigned long flags;
+
+    switch (cmd)
+    {
+    case SETDEBOUNCE_CMD:
+        if(copy_from_user(&deb, (void __user *)arg, sizeof(deb)))
+            return -EFAULT;
+        if(deb.key >= KEY_NUM || deb.us < DEBOUNCE_MIN_US)
+            return -EINVAL;
+        /* 下一个边沿唤醒中断线程时生效 */
+        dev->irqkeydesc[deb.key].debounce_us = deb.us;
+        break;
+    case SETPRIO_CMD:
+        /* 中断线程自己设置优先级时不做权限检查，所以在这里检查调用者 */
+        if(!capable(CAP_SYS_NICE))
+            return -EPERM;
+        if(arg < 1 || arg >= MAX_USER_RT_PRIO)
+            return -EINVAL;
+        atomic_set(&dev->prio, arg);
+        break;
+    case SETMASK_CMD:
+        if(arg == 0 || (arg & ~KEY_EV_MASK_ALL))
+            return -EINVAL;
+        spin_lock_irqsave(&dev->lock, flags);
+        client->mask = arg;
+        spin_unlock_irqrestore(&dev->lock, flags);
+        break;
+    case SETGESTURE_CMD:
+        if(copy_from_user(&ges, (void __user *)arg, sizeof(ges)))
+            return -EFAULT;
+        if(ges.key >= KEY_NUM)
+            return -EINVAL;
+        keydesc = &dev->irqkeydesc[ges.key];
+        spin_lock_irqsave(&dev->lock, flags);
+        keydesc->long_ms = ges.long_ms;
+        keydesc->double_ms = ges.double_ms;
+        keydesc->repeat_ms = ges.repeat_ms;
+        keydesc->gesture = GESTURE_IDLE;
+        keydesc->gesture_deadline_ns = U64_MAX;
+        hrtimer_try_to_cancel(&keydesc->gesture_timer);
+        spin_unlock_irqrestore(&dev->lock, flags);
+        break;
+    case SETEVENTFD_CMD:
+        return keyirq_set_eventfd(client, (int)arg);
+    case SETSTORM_CMD:
+        if(arg > STORM_RATE_MAX)
+            return -EINVAL;
+        atomic_set(&dev->storm_rate, arg);
+        break;
+    case GETLATENCY_CMD:
+        if(copy_from_user(&lat, (void __user *)arg, sizeof(lat)))
+            return -EFAULT;
+        if(lat.key >= KEY_NUM)
+            return -EINVAL;
+        keydesc = &dev->irqkeydesc[lat.key];
+        spin_lock_irqsave(&dev->lock, flags);
+        lat.last_us = keydesc->lat_last_us;
+        lat.max_us = keydesc->lat_max_us;
+        lat.count = keydesc->lat_cnt;
+        lat.avg_us = keydesc->lat_cnt ? div_u64(keydesc->lat_sum_us, keydesc->lat_cnt) : 0;
+        spin_unlock_irqrestore(&dev->lock, flags);
+        if(copy_to_user((void __user *)arg, &lat, sizeof(lat)))
+            return -EFAULT;
+        break;
+    default:
+        return -ENOTTY;
     }
     return 0;
+}
+
+/* 映射过ring的文件按环是否为空判断可读，否则按自己的读位置之后是否有松开事件判断 */
+static unsigned int keyirq_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct keyirq_client *client = filp->private_data;
+    struct keyirq_dev *dev = client->dev;
+    unsigned int mask = 0;
 
-data_error:
-    return -EINVAL;
+    poll_wait(filp, &dev->r_wait, wait);
+
+    if(client->mapped) {
+        if(READ_ONCE(dev->map_head) != key_ring_tail(dev))
+            mask |= POLLIN | POLLRDNORM;
+    } else if(keyirq_client_ready(client)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    return mask;
 }
 
+static void keyirq_vm_open(struct vm_area_struct *vma)
+{
+    struct keyirq_dev *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->ring_maps);
+}
+
+static void keyirq_vm_close(struct vm_area_struct *vma)
+{
+    struct keyirq_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->ring_maps);
+}
+
+static const struct vm_operations_struct keyirq_vm_ops = {
+    .open = keyirq_vm_open,
+    .close = keyirq_vm_close,
+};
+
+/*
+* 只能从偏移0开始完整映射控制页加记录区
+* 必须是MAP_SHARED，私有映射写tail时会复制页，内核看不到tail的更新
+*/
+static int keyirq_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct keyirq_client *client = filp->private_data;
+    struct keyirq_dev *dev = client->dev;
+    int ret;
+
+    if(!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != RING_MMAP_SIZE)
+        return -EINVAL;
+
+    ret = remap_vmalloc_range(vma, dev->ring, 0);
+    if(ret < 0)
+        return ret;
+
+    vma->vm_ops = &keyirq_vm_ops;
+    vma->vm_private_data = dev;
+    keyirq_vm_open(vma);
+    client->mapped = true;
+    return 0;
+}
+
+/* debugfs: cat查看计数和直方图，写入任意内容清零 */
+static int keyirq_stats_show(struct seq_file *m, void *v)
+{
+    struct keyirq_dev *dev = m->private;
+    struct keyirq_stats stats;
+    struct keyirq_hist *hist;
+    unsigned long flags;
+    unsigned int i, n;
+
+    hist = kmalloc(sizeof(dev->hist), GFP_KERNEL);
+    if(hist == NULL)
+        return -ENOMEM;
+
+    /* 先拷贝一份，避免持锁打印 */
+    spin_lock_irqsave(&dev->lock, flags);
+    stats = dev->stats;
+    memcpy(hist, dev->hist, sizeof(dev->hist));
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    seq_printf(m, "events: %u\nspurious: %u\ndrops: %u\nreads: %u\ngestures: %u\n",
+               stats.events, stats.spurious, stats.drops, stats.reads, stats.gestures);
+    seq_printf(m, "scans: %u\nreg_reads: %u\npin_reads: %u\n",
+               stats.scans, stats.reg_reads, stats.pin_reads);
+    seq_printf(m, "nl_sent: %u\nnl_errors: %u\n", stats.nl_sent, stats.nl_errors);
+    seq_printf(m, "storm_rate: %d\nstorms: %u\nstorm_polls: %u\nstorm_ms: %llu\n",
+               atomic_read(&dev->storm_rate), stats.storms, stats.storm_polls,
+               div_u64(stats.storm_ns, NSEC_PER_MSEC));
+    for(i = 0; i < KEY_NUM; i ++)
+        seq_printf(m, "%s: %s\n", dev->irqkeydesc[i].name,
+                   dev->irqkeydesc[i].polling ? "polling" : "irq");
+    for(i = 0; i < HIST_NUM; i ++) {
+        seq_printf(m, "\n%s: count=%u avg=%lluus max=%uus\n", hist_names[i], hist[i].count,
+                   hist[i].count ? div_u64(hist[i].sum_us, hist[i].count) : 0, hist[i].max_us);
+        for(n = 0; n < HIST_BUCKETS; n ++) {
+            if(hist[i].bucket[n] == 0)
+                continue;
+            if(n == 0)
+                seq_printf(m, "  %10u us : %u\n", 0, hist[i].bucket[n]);
+            else
+                seq_printf(m, "  %10u us : %u\n", 1U << (n - 1), hist[i].bucket[n]);
+        }
+    }
+
+    kfree(hist);
+    return 0;
+}
+
+static int keyirq_stats_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, keyirq_stats_show, inode->i_private);
+}
+
+static ssize_t keyirq_stats_write(struct file *filp, const char __user *buf, size_t cnt, loff_t *offt)
+{
+    struct keyirq_dev *dev = ((struct seq_file *)filp->private_data)->private;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    memset(dev->hist, 0, sizeof(dev->hist));
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return cnt;
+}
+
+static const struct file_operations keyirq_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = keyirq_stats_open,
+    .read = seq_read,
+    .write = keyirq_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
 static struct file_operations keyirq_fops = {
     .owner = THIS_MODULE,
     .open = keyirq_open,
     .read = keyirq_read,
+    .poll = keyirq_poll,
+    .mmap = keyirq_mmap,
+    .unlocked_ioctl = keyirq_unlocked_ioctl,
+    .release = keyirq_release,
 };
 
+/* 分配mmap事件环并初始化控制页 */
+static int keyirq_ring_init(void)
+{
+    keyirq->ring = vmalloc_user(RING_MMAP_SIZE);
+    if(keyirq->ring == NULL)
+        return -ENOMEM;
+
+    keyirq->ctrl = keyirq->ring;
+    keyirq->events = keyirq->ring + PAGE_SIZE;
+    keyirq->ctrl->version = RING_VERSION;
+    keyirq->ctrl->entries = RING_ENTRIES;
+    keyirq->ctrl->entry_size = sizeof(struct key_event);
+    keyirq->ctrl->data_offset = PAGE_SIZE;
+    atomic_set(&keyirq->ring_maps, 0);
+    init_waitqueue_head(&keyirq->r_wait);
+    mutex_init(&keyirq->efd_lock);
+    INIT_LIST_HEAD(&keyirq->efd_list);
+    INIT_WORK(&keyirq->notify_work, keyirq_notify_work);
+    return 0;
+}
+
 static int __init keyirq_init(void)
 {
-    if(keyirq.major) {
-        keyirq.devid = MKDEV(keyirq.devid, 0);
-        register_chrdev_region(keyirq.devid, 0, KEYIRQ_NAME);
+    int ret;
+
+    keyirq = kzalloc(sizeof(*keyirq), GFP_KERNEL);
+    if(keyirq == NULL)
+        return -ENOMEM;
+
+    /* 事件环要在注册设备之前准备好，open之后就可以mmap */
+    ret = keyirq_ring_init();
+    if(ret < 0) {
+        kfree(keyirq);
+        return ret;
+    }
+
+    if(keyirq->major) {
+        keyirq->devid = MKDEV(keyirq->major, 0);
+        ret = register_chrdev_region(keyirq->devid, KEYIRQ_CNT, KEYIRQ_NAME);
     } else {
-        alloc_chrdev_region(&keyirq.devid, 0, KEYIRQ_CNT, KEYIRQ_NAME);
-        keyirq.major = MAJOR(keyirq.devid);
-        keyirq.minor = MINOR(keyirq.devid);
+        ret = alloc_chrdev_region(&keyirq->devid, 0, KEYIRQ_CNT, KEYIRQ_NAME);
+        keyirq->major = MAJOR(keyirq->devid);
+        keyirq->minor = MINOR(keyirq->devid);
     }
-    printk("major=%d, minor=%d\r\n", keyirq.major, keyirq.minor);
+    if(ret < 0)
+        goto err_region;
+    printk("major=%d, minor=%d\r\n", keyirq->major, keyirq->minor);
 
-    keyirq.cdev.owner = THIS_MODULE;
-    cdev_init(&keyirq.cdev, &keyirq_fops);
+    keyirq->cdev.owner = THIS_MODULE;
+    cdev_init(&keyirq->cdev, &keyirq_fops);
 
-    cdev_add(&keyirq.cdev, keyirq.devid, KEYIRQ_CNT);
+    ret = cdev_add(&keyirq->cdev, keyirq->devid, KEYIRQ_CNT);
+    if(ret < 0)
+        goto err_cdev;
 
-    keyirq.class = class_create(THIS_MODULE, KEYIRQ_NAME);
-    if(IS_ERR(keyirq.class)) {
-        return PTR_ERR(keyirq.class);
+    keyirq->class = keyirq_class_create(KEYIRQ_NAME);
+    if(IS_ERR(keyirq->class)) {
+        ret = PTR_ERR(keyirq->class);
+        goto err_class;
     }
-    keyirq.device = device_create(keyirq.class, NULL, keyirq.devid, NULL, KEYIRQ_NAME);
-    if(IS_ERR(keyirq.device)) {
-        return PTR_ERR(keyirq.device);
+    keyirq->device = device_create(keyirq->class, NULL, keyirq->devid, NULL, KEYIRQ_NAME);
+    if(IS_ERR(keyirq->device)) {
+        ret = PTR_ERR(keyirq->device);
+        goto err_device;
     }
 
     /* 初始化按键 */
-    atomic_set(&keyirq.keyvalue, INVAKEY);
-    atomic_set(&keyirq.releasekey, 0);
-    keyio_init();
+    spin_lock_init(&keyirq->lock);
+    mutex_init(&keyirq->scan_lock);
+    if(irq_prio < 1 || irq_prio >= MAX_USER_RT_PRIO)
+        irq_prio = IRQ_PRIO_DEF;
+    atomic_set(&keyirq->prio, irq_prio);
+    atomic_set(&keyirq->storm_rate, clamp(storm_rate, 0, STORM_RATE_MAX));
+
+    /* 只有组播组，没有命令，所以ops为空 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+    ret = genl_register_family(&keyirq_genl_family);
+#else
+    ret = _genl_register_family_with_ops_grps(&keyirq_genl_family, NULL, 0,
+                                              keyirq_genl_mcgrps, ARRAY_SIZE(keyirq_genl_mcgrps));
+#endif
+    if(ret < 0)
+        printk("register generic netlink family failed!\r\n");
+    else
+        keyirq->genl_registered = true;
+
+    /* /sys/kernel/debug/keyirq/stats，没有使能debugfs时忽略 */
+    keyirq->debugfs = debugfs_create_dir(KEYIRQ_NAME, NULL);
+    if(!IS_ERR_OR_NULL(keyirq->debugfs))
+        debugfs_create_file("stats", 0644, keyirq->debugfs, keyirq, &keyirq_stats_fops);
+
+    /* 没有/key节点又没有给出gpios时在这里失败，模块不能加载 */
+    ret = keyio_init();
+    if(ret < 0)
+        goto err_keyio;
     return 0;
+
+err_keyio:
+    debugfs_remove_recursive(keyirq->debugfs);
+    if(keyirq->genl_registered)
+        genl_unregister_family(&keyirq_genl_family);
+    device_destroy(keyirq->class, keyirq->devid);
+err_device:
+    class_destroy(keyirq->class);
+err_class:
+    /* cdev_del之后不会再有新的open，之后才能释放keyirq */
+    cdev_del(&keyirq->cdev);
+err_cdev:
+    unregister_chrdev_region(keyirq->devid, KEYIRQ_CNT);
+err_region:
+    vfree(keyirq->ring);
+    kfree(keyirq);
+    keyirq = NULL;
+    return ret;
 }
 
 static void __exit keyirq_exit(void)
 {
     unsigned int i;
-    del_timer_sync(&keyirq.timer);
 
-    for(i = 0; i < KEY_NUM; i ++) {
-        free_irq(keyirq.irqkeydesc[i].irqnum, &keyirq);
-        gpio_free(keyirq.irqkeydesc[i].gpio);
-    }
-    device_destroy(keyirq.class, keyirq.devid);
-    class_destroy(keyirq.class);
-    cdev_del(&keyirq.cdev);
-    unregister_chrdev_region(keyirq.devid, KEYIRQ_CNT);
+    keyio_free_irqs(KEY_NUM);
+    for(i = 0; i < KEY_NUM; i ++)
+        gpio_free(keyirq->irqkeydesc[i].gpio);
+    keybank_exit();
+    /* 中断已经释放，不会再有新的通知排队 */
+    flush_work(&keyirq->notify_work);
+    if(keyirq->genl_registered)
+        genl_unregister_family(&keyirq_genl_family);
+    debugfs_remove_recursive(keyirq->debugfs);
+    /* input_unregister_device会同时释放input设备 */
+    if(keyirq->inputdev)
+        input_unregister_device(keyirq->inputdev);
+    device_destroy(keyirq->class, keyirq->devid);
+    class_destroy(keyirq->class);
+    cdev_del(&keyirq->cdev);
+    unregister_chrdev_region(keyirq->devid, KEYIRQ_CNT);
+    /* 模块卸载时已经没有打开的文件，也就没有映射 */
+    vfree(keyirq->ring);
+    kfree(keyirq);
 }
 
 module_init(keyirq_init);
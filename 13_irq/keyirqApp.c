@@ -2,37 +2,430 @@
 #include "unistd.h"
 #include "sys/types.h"
 #include "sys/stat.h"
+#include "sys/ioctl.h"
+#include "sys/mman.h"
+#include "sys/eventfd.h"
+#include "stdint.h"
+#include "poll.h"
 #include "fcntl.h"
 #include "stdlib.h"
 #include "string.h"
+#include "sys/socket.h"
 #include "linux/ioctl.h"
+#include "linux/types.h"
+#include "linux/netlink.h"
+#include "linux/genetlink.h"
 
+struct key_debounce {
+    unsigned int key;
+    unsigned int us;
+};
+
+struct key_gesture {
+    unsigned int key;
+    unsigned int long_ms;
+    unsigned int double_ms;
+    unsigned int repeat_ms;
+};
+
+struct key_latency {
+    unsigned int key;
+    unsigned int last_us;
+    unsigned int max_us;
+    unsigned int avg_us;
+    unsigned int count;
+};
+
+/* mmap事件环，与驱动中的定义一致 */
+struct key_event {
+    __u64 time_ns;
+    __u32 seq;
+    __u16 code;
+    __u8 key;
+    __u8 value;
+};
+
+struct key_ring_ctrl {
+    __u32 version;
+    __u32 entries;
+    __u32 entry_size;
+    __u32 data_offset;
+    __u32 head;
+    __u32 tail;
+    __u32 lost;
+    __u32 reserved;
+};
+
+#define RING_ENTRIES        1024
+
+/* generic netlink，与驱动中的定义一致 */
+#define KEYIRQ_GENL_NAME    "keyirq"
+#define KEYIRQ_GENL_MCGRP   "events"
+
+enum {
+    KEYIRQ_C_UNSPEC,
+    KEYIRQ_C_EVENT,
+};
+
+enum {
+    KEYIRQ_A_UNSPEC,
+    KEYIRQ_A_TIME,
+    KEYIRQ_A_SEQ,
+    KEYIRQ_A_CODE,
+    KEYIRQ_A_KEY,
+    KEYIRQ_A_VALUE,
+    KEYIRQ_A_PAD,
+    __KEYIRQ_A_MAX,
+};
+
+#define SETDEBOUNCE_CMD     (_IOW(0XEF, 0X1, struct key_debounce))
+#define GETLATENCY_CMD      (_IOWR(0XEF, 0X2, struct key_latency))
+#define SETPRIO_CMD         (_IO(0XEF, 0X3))
+#define SETSTORM_CMD        (_IO(0XEF, 0X4))
+#define SETEVENTFD_CMD      (_IO(0XEF, 0X5))
+#define SETMASK_CMD         (_IO(0XEF, 0X6))
+#define SETGESTURE_CMD      (_IOW(0XEF, 0X7, struct key_gesture))
+
+/* 事件类型，与驱动中的KEY_EV_xxx一致 */
+static const char * const ev_names[] = {
+    "release", "press", "repeat", "long", "double",
+};
+#define KEY_EV_NUM          5
+
+/* read返回的每个字节: 低4位为按键值，高4位为事件类型 */
+static void print_key_byte(unsigned char data)
+{
+    if((data >> 4) < KEY_EV_NUM)
+        printf("key value = %#X %s\r\n", data & 0x0F, ev_names[data >> 4]);
+    else
+        printf("key value = %#X\r\n", data);
+}
+
+/*
+* 从mmap事件环中读取事件，环为空时用poll睡眠
+* 每次醒来把head之前的记录全部取走，不需要每个事件一次系统调用
+*/
+static int ring_loop(int fd)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t size = pagesize + ((RING_ENTRIES * sizeof(struct key_event) + pagesize - 1) & ~(pagesize - 1));
+    struct key_ring_ctrl *ctrl;
+    struct key_event *events, *ev;
+    struct pollfd fds;
+    __u32 head, tail;
+    void *map;
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        printf("mmap ring failed!\r\n");
+        return -1;
+    }
+    ctrl = map;
+    events = (struct key_event *)((char *)map + ctrl->data_offset);
+
+    fds.fd = fd;
+    fds.events = POLLIN;
+    while(1) {
+        head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+        tail = ctrl->tail;
+        if(head == tail) {
+            poll(&fds, 1, -1);
+            continue;
+        }
+        for(; tail != head; tail ++) {
+            ev = &events[tail & (ctrl->entries - 1)];
+            printf("seq=%u key%u code=%u %s t=%llu.%06llums lost=%u\r\n", ev->seq, ev->key, ev->code,
+                   ev->value < KEY_EV_NUM ? ev_names[ev->value] : "?", ev->time_ns / 1000000,
+                   ev->time_ns % 1000000, ctrl->lost);
+        }
+        /* 记录读完之后才能把空间还给内核 */
+        __atomic_store_n(&ctrl->tail, tail, __ATOMIC_RELEASE);
+    }
+    munmap(map, size);
+    return 0;
+}
+
+/*
+* 注册eventfd，在eventfd上等待，醒来后用非阻塞read取走这一批事件
+* eventfd的计数就是驱动通知的批数
+*/
+static int eventfd_loop(int fd)
+{
+    int efd, ret, i;
+    uint64_t batches;
+    unsigned char data[16];
+
+    efd = eventfd(0, 0);
+    if(efd < 0) {
+        printf("create eventfd failed!\r\n");
+        return -1;
+    }
+    if(ioctl(fd, SETEVENTFD_CMD, efd) < 0) {
+        printf("register eventfd failed!\r\n");
+        close(efd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    while(1) {
+        if(read(efd, &batches, sizeof(batches)) != sizeof(batches))
+            continue;
+        printf("eventfd: %llu batch(es)\r\n", (unsigned long long)batches);
+        while((ret = read(fd, data, sizeof(data))) > 0) {
+            for(i = 0; i < ret; i ++)
+                print_key_byte(data[i]);
+        }
+    }
+    close(efd);
+    return 0;
+}
+
+#define GENL_BUF_SIZE       4096
+#define NLA_DATA(nla)       ((void *)((char *)(nla) + NLA_HDRLEN))
+
+/* 遍历一段netlink属性，把类型不超过max的属性填入tb */
+static void nla_parse_simple(struct nlattr **tb, int max, struct nlattr *nla, int len)
+{
+    memset(tb, 0, sizeof(*tb) * (max + 1));
+    while(len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= len) {
+        if((nla->nla_type & NLA_TYPE_MASK) <= max)
+            tb[nla->nla_type & NLA_TYPE_MASK] = nla;
+        len -= NLA_ALIGN(nla->nla_len);
+        nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+    }
+}
+
+/* 通过CTRL_CMD_GETFAMILY查询keyirq族的族号和events组的组号 */
+static int genl_resolve(int sock, int *family, int *group)
+{
+    char buf[GENL_BUF_SIZE];
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    struct genlmsghdr *genlh;
+    struct nlattr *nla, *tb[CTRL_ATTR_MAX + 1], *gtb[CTRL_ATTR_MCAST_GRP_MAX + 1], *grp;
+    int len, rem;
+
+    memset(buf, 0, sizeof(buf));
+    nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    nlh->nlmsg_type = GENL_ID_CTRL;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    genlh = NLMSG_DATA(nlh);
+    genlh->cmd = CTRL_CMD_GETFAMILY;
+    genlh->version = 1;
+    nla = (struct nlattr *)((char *)genlh + GENL_HDRLEN);
+    nla->nla_type = CTRL_ATTR_FAMILY_NAME;
+    nla->nla_len = NLA_HDRLEN + strlen(KEYIRQ_GENL_NAME) + 1;
+    strcpy(NLA_DATA(nla), KEYIRQ_GENL_NAME);
+    nlh->nlmsg_len += NLA_ALIGN(nla->nla_len);
+
+    if(send(sock, buf, nlh->nlmsg_len, 0) < 0)
+        return -1;
+    len = recv(sock, buf, sizeof(buf), 0);
+    if(len < 0 || !NLMSG_OK(nlh, len) || nlh->nlmsg_type != GENL_ID_CTRL)
+        return -1;
+
+    genlh = NLMSG_DATA(nlh);
+    nla_parse_simple(tb, CTRL_ATTR_MAX, (struct nlattr *)((char *)genlh + GENL_HDRLEN),
+                     nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+    if(tb[CTRL_ATTR_FAMILY_ID] == NULL || tb[CTRL_ATTR_MCAST_GROUPS] == NULL)
+        return -1;
+    *family = *(__u16 *)NLA_DATA(tb[CTRL_ATTR_FAMILY_ID]);
+
+    /* CTRL_ATTR_MCAST_GROUPS中每个组是一个嵌套属性 */
+    grp = NLA_DATA(tb[CTRL_ATTR_MCAST_GROUPS]);
+    rem = tb[CTRL_ATTR_MCAST_GROUPS]->nla_len - NLA_HDRLEN;
+    while(rem >= NLA_HDRLEN && grp->nla_len >= NLA_HDRLEN && grp->nla_len <= rem) {
+        nla_parse_simple(gtb, CTRL_ATTR_MCAST_GRP_MAX, NLA_DATA(grp), grp->nla_len - NLA_HDRLEN);
+        if(gtb[CTRL_ATTR_MCAST_GRP_NAME] && gtb[CTRL_ATTR_MCAST_GRP_ID] &&
+           strcmp(NLA_DATA(gtb[CTRL_ATTR_MCAST_GRP_NAME]), KEYIRQ_GENL_MCGRP) == 0) {
+            *group = *(__u32 *)NLA_DATA(gtb[CTRL_ATTR_MCAST_GRP_ID]);
+            return 0;
+        }
+        rem -= NLA_ALIGN(grp->nla_len);
+        grp = (struct nlattr *)((char *)grp + NLA_ALIGN(grp->nla_len));
+    }
+    return -1;
+}
+
+/* 加入keyirq的events组播组，每个事件由内核推送，不需要打开设备文件 */
+static int genl_loop(void)
+{
+    char buf[GENL_BUF_SIZE];
+    struct nlmsghdr *nlh;
+    struct genlmsghdr *genlh;
+    struct nlattr *tb[__KEYIRQ_A_MAX];
+    struct sockaddr_nl addr;
+    int sock, family, group, len;
+    __u64 time_ns;
+
+    sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    if(sock < 0) {
+        printf("create netlink socket failed!\r\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       genl_resolve(sock, &family, &group) < 0) {
+        printf("can't find generic netlink family %s!\r\n", KEYIRQ_GENL_NAME);
+        close(sock);
+        return -1;
+    }
+    if(setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+        printf("join multicast group failed!\r\n");
+        close(sock);
+        return -1;
+    }
+
+    while(1) {
+        len = recv(sock, buf, sizeof(buf), 0);
+        if(len < 0)
+            continue;
+        for(nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if(nlh->nlmsg_type != family)
+                continue;
+            genlh = NLMSG_DATA(nlh);
+            if(genlh->cmd != KEYIRQ_C_EVENT)
+                continue;
+            nla_parse_simple(tb, __KEYIRQ_A_MAX - 1, (struct nlattr *)((char *)genlh + GENL_HDRLEN),
+                             nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+            if(!tb[KEYIRQ_A_TIME] || !tb[KEYIRQ_A_SEQ] || !tb[KEYIRQ_A_CODE] ||
+               !tb[KEYIRQ_A_KEY] || !tb[KEYIRQ_A_VALUE])
+                continue;
+            memcpy(&time_ns, NLA_DATA(tb[KEYIRQ_A_TIME]), sizeof(time_ns));
+            printf("seq=%u key%u code=%u %s t=%llu.%06llums\r\n",
+                   *(__u32 *)NLA_DATA(tb[KEYIRQ_A_SEQ]), *(__u8 *)NLA_DATA(tb[KEYIRQ_A_KEY]),
+                   *(__u32 *)NLA_DATA(tb[KEYIRQ_A_CODE]),
+                   *(__u8 *)NLA_DATA(tb[KEYIRQ_A_VALUE]) < KEY_EV_NUM ?
+                   ev_names[*(__u8 *)NLA_DATA(tb[KEYIRQ_A_VALUE])] : "?",
+                   time_ns / 1000000, time_ns % 1000000);
+        }
+    }
+    close(sock);
+    return 0;
+}
+
+/*
+* 用法: ./keyirqApp [-d debounce_us] [-p prio] [-s storm_rate] [-g long:double:repeat] [-m | -e] /dev/keyirq
+*       ./keyirqApp -n
+* -d 设置key0的消抖时间，-p 设置中断线程的SCHED_FIFO优先级
+* -s 设置中断风暴阈值(边沿数/秒)，0关闭抑制
+* -g 打开key0的手势识别(单位ms，0关闭对应手势)，read只返回长按、双击和重复事件
+* -m 通过mmap事件环读取事件，-e 通过eventfd等待事件
+* 否则用read读取并打印按下到上报的延时
+* -n 订阅generic netlink组播，不需要打开设备文件
+*/
 int main(int argc, char *argv[])
 {
     int fd;
     int ret;
+    int opt, i;
+    int debounce = -1, prio = -1, storm = -1, use_ring = 0, use_eventfd = 0, use_genl = 0;
+    int use_gesture = 0;
+    struct key_gesture ges;
     char *filename;
-    unsigned char data;
+    unsigned char data[16];
+    struct key_debounce deb;
+    struct key_latency lat;
+
+    while((opt = getopt(argc, argv, "d:p:s:g:men")) != -1) {
+        switch(opt) {
+        case 'd': debounce = atoi(optarg); break;
+        case 'p': prio = atoi(optarg); break;
+        case 's': storm = atoi(optarg); break;
+        case 'm': use_ring = 1; break;
+        case 'e': use_eventfd = 1; break;
+        case 'n': use_genl = 1; break;
+        case 'g':
+            memset(&ges, 0, sizeof(ges));
+            if(sscanf(optarg, "%u:%u:%u", &ges.long_ms, &ges.double_ms, &ges.repeat_ms) < 1) {
+                printf("Error Usage!\r\n");
+                return -1;
+            }
+            use_gesture = 1;
+            break;
+        default:
+            printf("Error Usage!\r\n");
+            return -1;
+        }
+    }
+    if(use_genl)
+        return genl_loop();
 
-    if(argc != 2) {
+    if(optind != argc - 1) {
         printf("Error Usage!\r\n");
         return -1;
     }
 
-    filename = argv[1];
+    filename = argv[optind];
     fd = open(filename, O_RDWR);
     if (fd < 0) {
         printf("can't open file %s\r\n", filename);
         return -1;
     }
 
+    if(debounce >= 0) {
+        deb.key = 0;
+        deb.us = debounce;
+        ret = ioctl(fd, SETDEBOUNCE_CMD, &deb);
+        if(ret < 0) {
+            printf("set debounce %uus failed!\r\n", deb.us);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(prio >= 0) {
+        ret = ioctl(fd, SETPRIO_CMD, prio);
+        if(ret < 0) {
+            printf("set irq thread priority failed!\r\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(use_gesture) {
+        ges.key = 0;
+        /* 每个手势只唤醒一次，不再关心单独的按下和松开 */
+        if(ioctl(fd, SETGESTURE_CMD, &ges) < 0 ||
+           ioctl(fd, SETMASK_CMD, (1 << 2) | (1 << 3) | (1 << 4)) < 0) {
+            printf("set gesture failed!\r\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(storm >= 0) {
+        ret = ioctl(fd, SETSTORM_CMD, storm);
+        if(ret < 0) {
+            printf("set storm rate failed!\r\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(use_ring) {
+        ret = ring_loop(fd);
+        close(fd);
+        return ret;
+    }
+
+    if(use_eventfd) {
+        ret = eventfd_loop(fd);
+        close(fd);
+        return ret;
+    }
+
+    /* read在没有事件时阻塞，每个松开事件返回1字节，多个进程同时读互不影响 */
     while(1) {
-        ret = read(fd, &data, sizeof(data));
-        if (ret < 0) {
+        ret = read(fd, data, sizeof(data));
+        if (ret <= 0) {
 
         } else {
-            if (data) 
-                printf("key value = %#X\r\n", data);
+            for(i = 0; i < ret; i ++)
+                print_key_byte(data[i]);
+            lat.key = 0;
+            if(ioctl(fd, GETLATENCY_CMD, &lat) == 0)
+                printf("latency last=%uus max=%uus avg=%uus\r\n", lat.last_us, lat.max_us, lat.avg_us);
         }
     }
     close(fd);
@@ -0,0 +1,365 @@
+#include "stdio.h"
+#include "unistd.h"
+#include "sys/types.h"
+#include "sys/stat.h"
+#include "sys/ioctl.h"
+#include "sys/resource.h"
+#include "stdint.h"
+#include "poll.h"
+#include "fcntl.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "time.h"
+#include "pthread.h"
+#include "linux/ioctl.h"
+
+/*
+* keyirq压力测试，在没有开发板的x86上配合gpio-sim/gpio-mockup使用，见keystress.sh
+* 通过模拟GPIO的注入文件产生边沿，同时读取/dev/keyirq，统计送达的事件、丢弃、消抖正确性和CPU时间
+*/
+
+#define SETMASK_CMD         (_IO(0XEF, 0X6))
+#define KEY_EV_RELEASE      0
+#define KEY_EV_PRESS        1
+
+#define STATS_FILE          "/sys/kernel/debug/keyirq/stats"
+#define MAX_EVENTS          (1 << 20)
+
+/* 三种边沿模式 */
+enum {
+    PAT_CLEAN,          /* 干净的按下和松开 */
+    PAT_BOUNCY,         /* 每次按下和松开之前有若干次抖动 */
+    PAT_STORM,          /* 以固定速率连续翻转，最后停在松开 */
+};
+
+struct stress_cfg {
+    int pattern;
+    int presses;            /* clean/bouncy: 按键次数 */
+    int hold_ms;            /* 按下保持时间 */
+    int gap_ms;             /* 两次按键的间隔 */
+    int bounces;            /* bouncy: 每次动作前的抖动次数 */
+    int bounce_us;          /* bouncy: 抖动的间隔 */
+    int rate;               /* storm: 边沿数/秒 */
+    int storm_ms;           /* storm: 持续时间 */
+    int settle_ms;          /* 注入结束后等待驱动上报的时间 */
+    const char *low;        /* 写入注入文件表示低电平(按下) */
+    const char *high;       /* 写入注入文件表示高电平(松开) */
+};
+
+/* 读线程收到的事件 */
+static unsigned char events[MAX_EVENTS];
+static volatile int nevents;
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* 等到绝对时间deadline，小于200us时忙等，保证100k边沿/秒时的间隔精度 */
+static void wait_until(uint64_t deadline)
+{
+    struct timespec ts;
+    uint64_t now = now_ns();
+
+    if(deadline > now + 200000) {
+        deadline -= 100000;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        deadline += 100000;
+    }
+    while(now_ns() < deadline)
+        ;
+}
+
+static int inject(int fd, const char *level)
+{
+    if(pwrite(fd, level, strlen(level), 0) < 0) {
+        printf("inject failed: %s\r\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* 读线程：阻塞读取，每个字节一个事件，高4位为事件类型 */
+static void *reader(void *arg)
+{
+    int fd = *(int *)arg;
+    unsigned char buf[256];
+    struct pollfd fds;
+    int ret, i;
+
+    fds.fd = fd;
+    fds.events = POLLIN;
+    while(!stop) {
+        if(poll(&fds, 1, 50) <= 0)
+            continue;
+        ret = read(fd, buf, sizeof(buf));
+        for(i = 0; i < ret && nevents < MAX_EVENTS; i ++)
+            events[nevents ++] = buf[i];
+    }
+    return NULL;
+}
+
+/* 从debugfs中取出一项计数，没有debugfs时返回-1 */
+static long long stats_get(const char *name)
+{
+    char line[128];
+    size_t len = strlen(name);
+    long long value = -1;
+    FILE *fp;
+
+    fp = fopen(STATS_FILE, "r");
+    if(fp == NULL)
+        return -1;
+    while(fgets(line, sizeof(line), fp)) {
+        if(strncmp(line, name, len) == 0 && line[len] == ':') {
+            value = atoll(line + len + 1);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+/* 整个系统的内核态时间(system + irq + softirq)，单位ms */
+static long long kernel_ms(void)
+{
+    unsigned long long user, nice, sys, idle, iowait, irq, softirq;
+    FILE *fp;
+    int n;
+
+    fp = fopen("/proc/stat", "r");
+    if(fp == NULL)
+        return 0;
+    n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu",
+               &user, &nice, &sys, &idle, &iowait, &irq, &softirq);
+    fclose(fp);
+    if(n != 7)
+        return 0;
+    return (sys + irq + softirq) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+static long long self_sys_ms(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_stime.tv_sec * 1000LL + ru.ru_stime.tv_usec / 1000;
+}
+
+/* 一次动作，bouncy模式先抖动若干次，返回注入的边沿数 */
+static long press_edge(int fd, const struct stress_cfg *cfg, const char *target, const char *other)
+{
+    uint64_t t = now_ns();
+    long edges = 0;
+    int i;
+
+    if(cfg->pattern == PAT_BOUNCY) {
+        for(i = 0; i < cfg->bounces; i ++) {
+            inject(fd, target);
+            t += cfg->bounce_us * 1000ULL;
+            wait_until(t);
+            inject(fd, other);
+            t += cfg->bounce_us * 1000ULL;
+            wait_until(t);
+            edges += 2;
+        }
+    }
+    inject(fd, target);
+    return edges + 1;
+}
+
+static long run_presses(int fd, const struct stress_cfg *cfg)
+{
+    long edges = 0;
+    int i;
+
+    for(i = 0; i < cfg->presses && !stop; i ++) {
+        edges += press_edge(fd, cfg, cfg->low, cfg->high);
+        usleep(cfg->hold_ms * 1000);
+        edges += press_edge(fd, cfg, cfg->high, cfg->low);
+        usleep(cfg->gap_ms * 1000);
+    }
+    return edges;
+}
+
+static long run_storm(int fd, const struct stress_cfg *cfg)
+{
+    uint64_t interval = 1000000000ULL / cfg->rate;
+    uint64_t start = now_ns(), end = start + cfg->storm_ms * 1000000ULL;
+    uint64_t t = start;
+    long edges = 0;
+
+    while(t < end) {
+        inject(fd, (edges & 1) ? cfg->high : cfg->low);
+        edges ++;
+        t += interval;
+        wait_until(t);
+    }
+    /* 最后停在松开 */
+    if(edges & 1) {
+        inject(fd, cfg->high);
+        edges ++;
+    }
+    return edges;
+}
+
+/*
+* 检查消抖结果：事件必须按下、松开交替，最后一个是松开
+* clean和bouncy模式每次按键正好一对事件
+*/
+static int check_events(const struct stress_cfg *cfg, int n, long long storms)
+{
+    int i, type, expect = KEY_EV_PRESS;
+
+    for(i = 0; i < n; i ++) {
+        type = events[i] >> 4;
+        if(type != expect) {
+            printf("event %d: got type %d, want %d\r\n", i, type, expect);
+            return -1;
+        }
+        expect = !expect;
+    }
+    if(n && (events[n - 1] >> 4) != KEY_EV_RELEASE) {
+        printf("last event is not a release\r\n");
+        return -1;
+    }
+    /* 正常按键的抖动远低于风暴阈值，进入轮询模式会合并按键 */
+    if(cfg->pattern != PAT_STORM && storms > 0) {
+        printf("%lld storms without a storm pattern\r\n", storms);
+        return -1;
+    }
+    if(cfg->pattern != PAT_STORM && n != cfg->presses * 2) {
+        printf("got %d events, want %d\r\n", n, cfg->presses * 2);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* 用法: ./keystress -i inject_file [-t sim|mockup] [-p clean|bouncy|storm]
+*                   [-n presses] [-b bounces] [-r rate] [-d storm_ms] /dev/keyirq
+* -i 模拟GPIO的注入文件，gpio-sim为.../sim_gpioN/pull，gpio-mockup为debugfs中的行文件
+* -t 注入文件的格式，sim写pull-up/pull-down，mockup写1/0
+* -n clean/bouncy模式的按键次数，-b 每次动作前的抖动次数
+* -r storm模式的边沿速率(边沿数/秒)，-d storm模式的持续时间(ms)
+* 成功返回0，事件序列不正确返回1
+*/
+int main(int argc, char *argv[])
+{
+    struct stress_cfg cfg = {
+        .pattern = PAT_CLEAN, .presses = 20, .hold_ms = 50, .gap_ms = 50,
+        .bounces = 5, .bounce_us = 200, .rate = 100000, .storm_ms = 1000,
+        .settle_ms = 500, .low = "pull-down", .high = "pull-up",
+    };
+    const char *inject_file = NULL;
+    long long ev0, drops0, storms0, spurious0, k0, s0;
+    long long ev1, drops1, storms1, spurious1, k1, s1;
+    uint64_t t0, t1;
+    pthread_t tid;
+    long edges;
+    int fd, ifd, opt, n, ret;
+
+    while((opt = getopt(argc, argv, "i:t:p:n:b:r:d:")) != -1) {
+        switch(opt) {
+        case 'i': inject_file = optarg; break;
+        case 't':
+            if(strcmp(optarg, "mockup") == 0) {
+                cfg.low = "0";
+                cfg.high = "1";
+            }
+            break;
+        case 'p':
+            if(strcmp(optarg, "bouncy") == 0)
+                cfg.pattern = PAT_BOUNCY;
+            else if(strcmp(optarg, "storm") == 0)
+                cfg.pattern = PAT_STORM;
+            break;
+        case 'n': cfg.presses = atoi(optarg); break;
+        case 'b': cfg.bounces = atoi(optarg); break;
+        case 'r': cfg.rate = atoi(optarg); break;
+        case 'd': cfg.storm_ms = atoi(optarg); break;
+        default:
+            printf("Error Usage!\r\n");
+            return -1;
+        }
+    }
+    if(inject_file == NULL || optind != argc - 1 || cfg.rate <= 0) {
+        printf("Error Usage!\r\n");
+        return -1;
+    }
+
+    ifd = open(inject_file, O_WRONLY);
+    if(ifd < 0) {
+        printf("can't open %s\r\n", inject_file);
+        return -1;
+    }
+    fd = open(argv[optind], O_RDWR | O_NONBLOCK);
+    if(fd < 0) {
+        printf("can't open file %s\r\n", argv[optind]);
+        return -1;
+    }
+
+    /* 按下和松开都要，先停在松开并丢掉之前的事件 */
+    if(ioctl(fd, SETMASK_CMD, (1 << KEY_EV_RELEASE) | (1 << KEY_EV_PRESS)) < 0) {
+        printf("set mask failed!\r\n");
+        return -1;
+    }
+    inject(ifd, cfg.high);
+    usleep(cfg.settle_ms * 1000);
+    while(read(fd, events, sizeof(events)) > 0)
+        ;
+
+    ev0 = stats_get("events");
+    drops0 = stats_get("drops");
+    storms0 = stats_get("storms");
+    spurious0 = stats_get("spurious");
+    k0 = kernel_ms();
+    s0 = self_sys_ms();
+    pthread_create(&tid, NULL, reader, &fd);
+
+    t0 = now_ns();
+    if(cfg.pattern == PAT_STORM)
+        edges = run_storm(ifd, &cfg);
+    else
+        edges = run_presses(ifd, &cfg);
+    t1 = now_ns();
+
+    /* 等待消抖和风暴轮询结束 */
+    usleep(cfg.settle_ms * 1000);
+    stop = 1;
+    pthread_join(tid, NULL);
+    n = nevents;
+
+    ev1 = stats_get("events");
+    drops1 = stats_get("drops");
+    storms1 = stats_get("storms");
+    spurious1 = stats_get("spurious");
+    k1 = kernel_ms();
+    s1 = self_sys_ms();
+
+    printf("edges injected: %ld in %llu ms (%llu edges/s)\r\n", edges,
+           (unsigned long long)(t1 - t0) / 1000000,
+           (unsigned long long)(edges * 1000000000ULL / (t1 - t0 ? t1 - t0 : 1)));
+    printf("events read: %d\r\n", n);
+    if(ev0 >= 0) {
+        printf("driver events: %lld, spurious: %lld, drops: %lld, storms: %lld\r\n",
+               ev1 - ev0, spurious1 - spurious0, drops1 - drops0, storms1 - storms0);
+    }
+    /* 注入本身的系统调用时间也算在内核态时间中，减掉 */
+    printf("kernel cpu: %lld ms, injector: %lld ms, driver path: %lld ms\r\n",
+           k1 - k0, s1 - s0, (k1 - k0) - (s1 - s0));
+
+    ret = check_events(&cfg, n, ev0 >= 0 ? storms1 - storms0 : 0);
+    printf("debounce: %s\r\n", ret == 0 ? "ok" : "FAILED");
+
+    close(fd);
+    close(ifd);
+    return ret == 0 ? 0 : 1;
+}
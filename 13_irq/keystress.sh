@@ -0,0 +1,92 @@
+#!/bin/bash
+# keyirq压力测试，在x86主机上用gpio-sim(没有时用gpio-mockup)代替开发板上的按键
+# 用法: sudo ./keystress.sh [storm_rate]
+# storm_rate默认与驱动的STORM_RATE_DEF相同，clean和bouncy不应触发风暴，只有storm场景的速率高于它
+# 需要root，内核打开CONFIG_GPIO_SIM或CONFIG_GPIO_MOCKUP以及debugfs，keyirq.ko按当前内核编译:
+#   make KERNELDIR=/lib/modules/$(uname -r)/build
+# gpio-sim需要5.17以后的内核，gpio-mockup注入中断需要4.16以后，keyirq.c按LINUX_VERSION_CODE兼容这些内核的接口
+file_name="keyirq"
+
+ko_file="${file_name}.ko"
+stress_file="keystress"
+sim_dir="/sys/kernel/config/gpio-sim/${file_name}"
+storm_rate="${1:-5000}"
+
+mode=""
+inject_file=""
+gpio_base=""
+
+cleanup() {
+    rmmod "$file_name" 2>/dev/null
+    if [ "$mode" = "sim" ]; then
+        echo 0 > "${sim_dir}/live"
+        rmdir "${sim_dir}/bank0/line0" "${sim_dir}/bank0" "$sim_dir"
+    elif [ "$mode" = "mockup" ]; then
+        rmmod gpio-mockup
+    fi
+}
+
+# 从/sys/kernel/debug/gpio中取出gpiochip的全局编号起点
+chip_base() {
+    grep -i "^$1:" /sys/kernel/debug/gpio | sed -n 's/.*[Gg][Pp][Ii][Oo][Ss] \([0-9]*\)-.*/\1/p'
+}
+
+setup_sim() {
+    modprobe gpio-sim 2>/dev/null
+    mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+    [ -d /sys/kernel/config/gpio-sim ] || return 1
+
+    mkdir -p "${sim_dir}/bank0/line0" || return 1
+    echo 1 > "${sim_dir}/bank0/num_lines"
+    echo 1 > "${sim_dir}/live" || return 1
+    mode="sim"
+
+    local dev_name chip_name
+    dev_name=$(cat "${sim_dir}/dev_name")
+    chip_name=$(cat "${sim_dir}/bank0/chip_name")
+    inject_file="/sys/devices/platform/${dev_name}/${chip_name}/sim_gpio0/pull"
+    gpio_base=$(chip_base "$chip_name")
+}
+
+setup_mockup() {
+    modprobe gpio-mockup gpio_mockup_ranges=-1,1 || return 1
+    mode="mockup"
+
+    local chip_name
+    chip_name=$(grep -i "gpio-mockup" /sys/kernel/debug/gpio | head -n 1 | cut -d: -f1)
+    [ -n "$chip_name" ] || return 1
+    # 4.x内核的注入目录为gpio-mockup-event/gpio-mockup-A，之后的内核为gpio-mockup/gpiochipN
+    if [ -e "/sys/kernel/debug/gpio-mockup/${chip_name}/0" ]; then
+        inject_file="/sys/kernel/debug/gpio-mockup/${chip_name}/0"
+    else
+        inject_file="/sys/kernel/debug/gpio-mockup-event/gpio-mockup-A/0"
+    fi
+    gpio_base=$(chip_base "$chip_name")
+}
+
+trap cleanup EXIT
+
+setup_sim || setup_mockup || { echo "no gpio-sim or gpio-mockup"; exit 1; }
+if [ -z "$gpio_base" ] || [ ! -e "$inject_file" ]; then
+    echo "can't find the simulated gpio"
+    exit 1
+fi
+echo "${mode}: gpio ${gpio_base}, inject ${inject_file}"
+
+gcc -O2 -pthread "${stress_file}.c" -o "$stress_file" || exit 1
+insmod "$ko_file" gpios="$gpio_base" storm_rate="$storm_rate" || exit 1
+
+fail=0
+run() {
+    echo "== $*"
+    ./"$stress_file" -i "$inject_file" -t "$mode" "$@" /dev/keyirq || fail=1
+    cat /sys/kernel/debug/keyirq/stats | head -n 16
+    echo reset > /sys/kernel/debug/keyirq/stats
+}
+
+run -p clean -n 50
+run -p bouncy -n 50 -b 8
+run -p storm -r 10000 -d 1000
+run -p storm -r 100000 -d 1000
+
+exit $fail